@@ -0,0 +1,346 @@
+
+#include "../src/myhttpd.h"
+#include "../src/pool.h"
+#include "../src/policy.h"
+#include "../src/cache.h"
+#include <new>
+#include <cstdlib>
+#include <cstdio>
+#include <random>
+
+/*
+ * Microbenchmarks of the per-request functions. Every benchmark runs for about
+ * BENCH_TIME_NS after a warm-up and reports time and heap allocations per
+ * operation. Allocations are counted by replacing global operator new.
+ */
+#define BENCH_TIME_NS                       200000000
+#define BENCH_QUEUE_SIZE                    1024
+#define BENCH_FUZZ_ROUNDS                   200000
+#define BENCH_FAIR_CLIENTS                  4
+#define BENCH_FAIR_REQUESTS                 5           // queued by every client
+
+static std::atomic<unsigned long> allocations(0);
+
+/*
+ * Replacements pair new with malloc and delete with free on purpose, to count
+ * allocations. Once inlined, GCC 11 and newer take the free for a mismatch.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void * operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void * p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void * operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void * p) noexcept {
+    free(p);
+}
+
+void operator delete[](void * p) noexcept {
+    free(p);
+}
+
+void operator delete(void * p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void * p, size_t) noexcept {
+    free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+/* Keeps compiler from optimizing away a result */
+template <typename T>
+static inline void keep(T const & value) {
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+/* Runs op in growing batches until BENCH_TIME_NS is spent, ops counts operations per call */
+template <typename F>
+static void run(const char * name, F op, unsigned ops = 1) {
+    for (int i=0; i<1000; i++) op();
+    unsigned long iterations = 1000, spent = 0, allocated = 0;
+    while (true) {
+        unsigned long before = allocations.load();
+        uint64_t start = monotonic_ns();
+        for (unsigned long i=0; i<iterations; i++) op();
+        spent = monotonic_ns() - start;
+        allocated = allocations.load() - before;
+        if (spent >= BENCH_TIME_NS) break;
+        iterations *= 2;
+    }
+    double n = (double) iterations * ops;
+    printf("%-32s %10.1f ns/op %8.2f allocs/op\n", name, spent / n, allocated / n);
+}
+
+/* Pushes BENCH_QUEUE_SIZE requests of mixed sizes into the queue and pops all of them */
+static void bench_queue(const char * name) {
+    scheduling_policy = make_policy(name, SERVER_DEFAULT_AGING_RATE);
+    std::vector<http_request> reqs(BENCH_QUEUE_SIZE);
+    for (int i=0; i<BENCH_QUEUE_SIZE; i++) {
+        reqs[i].f_size = (i * 7919) % 65536;
+        reqs[i].arrival_ns = 1000000000ULL + i * 1000;
+    }
+    /* Queue keeps its storage after the warm-up, as it does in the server */
+    http_request_queue queue;
+    uint64_t seq = 0;
+    std::string label = std::string("queue push+pop ") + name;
+    run(label.c_str(), [&]() {
+        for (int i=0; i<BENCH_QUEUE_SIZE; i++) {
+            reqs[i].key = scheduling_policy->key(&reqs[i]);
+            reqs[i].seq = seq++;
+            queue.push(&reqs[i]);
+        }
+        while (!queue.empty()) {
+            keep(queue.top());
+            queue.pop();
+        }
+    }, BENCH_QUEUE_SIZE);
+    delete scheduling_policy;
+}
+
+/* Helper method checks that a parsed field lies inside the parsed bytes */
+static bool inside(const str_view & field, const char * buf, size_t len) {
+    return field.empty() || (field.data >= buf && field.data + field.len <= buf + len);
+}
+
+/* Helper method checks that two parsers produced the same request */
+static bool same_head(const RequestParser & p1, const RequestParser & p2) {
+    if (p1.head_length() != p2.head_length() || p1.header_count != p2.header_count
+        || strcmp(p1.method.data, p2.method.data) || strcmp(p1.target.data, p2.target.data)
+        || strcmp(p1.version.data, p2.version.data))
+        return false;
+    for (int i=0; i<p1.header_count; i++)
+        if (strcmp(p1.headers[i].name.data, p2.headers[i].name.data)
+            || strcmp(p1.headers[i].value.data, p2.headers[i].value.data))
+            return false;
+    return true;
+}
+
+/*
+ * Randomized check of the request parser. Valid heads are mutated by replacing,
+ * inserting and cutting bytes, then parsed at once and in random pieces. Both
+ * ways must agree and every field must lie inside the buffer. Returns number
+ * of failed inputs.
+ */
+static unsigned fuzz_parser() {
+    const char * seeds[] = {
+        "GET /index.html HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n",
+        "HEAD /pic.jpg HTTP/1.0\r\nRange: bytes=0-99\r\nIf-Modified-Since: Sat, 01 Apr 2017 00:00:00 GMT\r\n\r\n",
+        "GET /dir/ HTTP/1.1\nAccept-Encoding: gzip, deflate\n\n",
+        "\r\nGET /~user/page.html\r\n",
+        "GET / HTTP/1.1\r\nA:\r\nB:   spaced   \r\n\r\nGET /next HTTP/1.1\r\n\r\n",
+    };
+    const char alphabet[] = "\0\r\n :\tGET/HTTP1.0aZ~%";
+    std::mt19937 rng(20170401);
+    unsigned failed = 0, accepted = 0, rejected = 0, incomplete = 0;
+    for (unsigned round=0; round<BENCH_FUZZ_ROUNDS; round++) {
+        std::string input = seeds[rng() % (sizeof(seeds) / sizeof(seeds[0]))];
+        for (unsigned m=rng() % 5; m; m--) {
+            size_t at = rng() % (input.size() + 1);
+            char c = (rng() & 1) ? alphabet[rng() % (sizeof(alphabet) - 1)] : (char) rng();
+            switch (rng() % 4) {
+                case 0: if (at < input.size()) input[at] = c; break;
+                case 1: input.insert(input.begin() + at, c); break;
+                case 2: input.erase(at, rng() % 8); break;
+                case 3: input.insert(at, input.substr(0, rng() % 64)); break;
+            }
+        }
+        if (input.size() > CON_BUFFER_LENGTH) input.resize(CON_BUFFER_LENGTH);
+        size_t len = input.size();
+        std::vector<char> whole(input.begin(), input.end()), pieces(len + 1);
+        whole.push_back('\0');
+        RequestParser p1, p2;
+        parse_result r1 = p1.parse(whole.data(), len), r2 = PARSE_INCOMPLETE;
+        size_t have = 0;
+        while (have < len && r2 == PARSE_INCOMPLETE) {
+            size_t step = std::min<size_t>(1 + rng() % 64, len - have);
+            memcpy(pieces.data() + have, input.data() + have, step);
+            have += step;
+            pieces[have] = '\0';
+            r2 = p2.parse(pieces.data(), have);
+        }
+        bool ok = r1 == r2 && (r1 != PARSE_DONE || same_head(p1, p2));
+        if (r1 == PARSE_INCOMPLETE) {
+            incomplete++;
+            r1 = p1.parse(whole.data(), len, true);
+        }
+        ok = ok && inside(p1.method, whole.data(), len) && inside(p1.target, whole.data(), len)
+             && inside(p1.version, whole.data(), len) && p1.head_length() <= len;
+        for (int i=0; ok && i<p1.header_count; i++)
+            ok = inside(p1.headers[i].name, whole.data(), len) && inside(p1.headers[i].value, whole.data(), len);
+        if (r1 == PARSE_DONE) accepted++;
+        else if (r1 == PARSE_ERROR) rejected++;
+        if (!ok && failed++ < 5) {
+            printf("parser mismatch on input:");
+            for (size_t i=0; i<len; i++) printf(" %02x", (unsigned char) input[i]);
+            printf("\n");
+        }
+    }
+    printf("parser fuzz: %u inputs, %u accepted, %u rejected, %u incomplete, %u failed\n",
+           BENCH_FUZZ_ROUNDS, accepted, rejected, incomplete, failed);
+    return failed;
+}
+
+/*
+ * Serves a cached file end to end on a reused request object, from the parsed
+ * head to the log line, in a temporary root directory.
+ */
+static void bench_serve_cached() {
+    char root[] = "/tmp/myhttpd-bench-XXXXXX";
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)) || !mkdtemp(root) || chdir(root)) return;
+    std::vector<char> body(16384, 'x');
+    int fd = open("page.jpg", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd != -1 && write(fd, body.data(), body.size()) == (ssize_t) body.size();
+    if (fd != -1) close(fd);
+    const char * head = "GET /page.jpg HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n";
+    char buf[CON_BUFFER_LENGTH + 1];
+    strcpy(buf, head);
+    RequestParser parser;
+    if (ok && parser.parse(buf, strlen(head)) == PARSE_DONE) {
+        http_request req;
+        run("serve cached file", [&]() {
+            init_request(&req, 0, parser, "127.0.0.1");
+            prepare_response(&req, req.response, monotonic_ns());
+            char line[LOG_LINE_LENGTH];
+            size_t len = get_logstring(&req, req.response, line);
+            keep(len);
+            req.response.cached.reset();
+        });
+        /* Parts and scratch of the reused request keep their capacity between multipart responses */
+        const char * ranges = "GET /page.jpg HTTP/1.1\r\nHost: localhost\r\nRange: bytes=0-99,1000-1999\r\n\r\n";
+        strcpy(buf, ranges);
+        parser.reset();
+        if (parser.parse(buf, strlen(ranges)) == PARSE_DONE)
+            run("serve cached file, two ranges", [&]() {
+                init_request(&req, 0, parser, "127.0.0.1");
+                prepare_response(&req, req.response, monotonic_ns());
+                keep(req.response.parts.size());
+                req.response.cached.reset();
+            });
+    }
+    unlink("page.jpg");
+    if (chdir(cwd)) {}
+    rmdir(root);
+}
+
+/*
+ * Check of fair batches with capped clients. Requests are taken in batches
+ * the way a worker refills its deque, and finished after each batch; a batch
+ * may end early when every client is at its cap but must not lose a request
+ * or give a client more than its cap. Returns number of failed cases.
+ */
+static unsigned check_fair_batches() {
+    scheduling_policy = make_policy("FCFS", SERVER_DEFAULT_AGING_RATE);
+    unsigned failed = 0, cases = 0;
+    for (unsigned cap=1; cap<=3; cap++) {
+        for (int clients=1; clients<=BENCH_FAIR_CLIENTS; clients++) {
+            for (int size=1; size<=POOL_BATCH_MAX; size++) {
+                cases++;
+                FairQueue fair(32, cap);
+                std::vector<http_request> reqs(clients * BENCH_FAIR_REQUESTS);
+                for (size_t i=0; i<reqs.size(); i++) {
+                    reqs[i].client_addr = 0x7f000001 + i % clients;
+                    reqs[i].key = scheduling_policy->key(&reqs[i]);
+                    reqs[i].seq = i;
+                    fair.push(&reqs[i]);
+                }
+                size_t served = 0;
+                bool ok = true;
+                http_request * batch[POOL_BATCH_MAX];
+                while (ok && !fair.empty()) {
+                    int n = fair.pop(batch, size);
+                    std::vector<unsigned> taken(clients, 0);
+                    for (int i=0; i<n; i++) {
+                        int client = batch[i]->client_addr - 0x7f000001;
+                        ok = ok && ++taken[client] <= cap;
+                    }
+                    ok = ok && n > 0;
+                    served += n;
+                    for (int i=0; i<n; i++) fair.finished(batch[i]->fair);
+                }
+                if (!ok || served != reqs.size() || fair.size()) failed++;
+            }
+        }
+    }
+    delete scheduling_policy;
+    printf("fair batches: %u cases, %u failed\n", cases, failed);
+    return failed;
+}
+
+int main() {
+    init_header_templates();
+
+    std::string path;
+    run("normalize_path", [&]() {
+        normalize_path("/images/photos/2017/holiday.jpg", path);
+        keep(path);
+    });
+
+    const char * head = "GET /images/photos/2017/holiday.jpg HTTP/1.1\r\nHost: localhost\r\n"
+                        "User-Agent: bench\r\nAccept: */*\r\nConnection: keep-alive\r\n\r\n";
+    size_t head_len = strlen(head);
+    char buf[CON_BUFFER_LENGTH + 1];
+    RequestParser parser;
+    run("parse request head", [&]() {
+        memcpy(buf, head, head_len + 1);
+        parser.reset();
+        parse_result result = parser.parse(buf, head_len);
+        keep(result);
+    });
+    http_request req;
+    run("init_request", [&]() {
+        init_request(&req, 0, parser, "127.0.0.1");
+        keep(req);
+    });
+
+    run("get_file_extension", []() {
+        extension type = get_file_extension("./images/photos/2017/holiday.jpg");
+        keep(type);
+    });
+
+    http_response resp;
+    resp.req_status = HTTP_STATUS_CODE_OK;
+    resp.content_type = JPEG;
+    resp.content_length = 64103;
+    resp.mod_time = 1491004800;
+    resp.keep_alive = true;
+    run("build_response_header", [&]() {
+        build_response_header(resp);
+        keep(resp.header_len);
+    });
+    char cached_date[HTTP_DATE_LENGTH + 1];
+    format_http_date(resp.mod_time, cached_date);
+    resp.last_modified = cached_date;
+    run("build_response_header cached", [&]() {
+        build_response_header(resp);
+        keep(resp.header_len);
+    });
+
+    init_request(&req, 0, parser, "127.0.0.1");
+    run("get_logstring", [&]() {
+        char line[LOG_LINE_LENGTH];
+        size_t len = get_logstring(&req, resp, line);
+        keep(len);
+    });
+
+    bench_serve_cached();
+
+    const char * policies[] = {"FCFS", "SJF", "SRPT", "EDF"};
+    for (int i=0; i<4; i++) bench_queue(policies[i]);
+    unsigned failed = check_fair_batches();
+    failed += fuzz_parser();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
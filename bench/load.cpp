@@ -0,0 +1,528 @@
+#include "../src/histogram.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <fstream>
+
+/*
+ * Load generator for a local server. Closed loop keeps a fixed number of
+ * connections, each sending its next request as soon as the previous answer
+ * is complete. Open loop sends requests at their arrival times, at a fixed
+ * rate or at the times of a replayed access log, whether or not earlier ones
+ * were answered; latency is counted from the arrival time, so time a request
+ * waits for a free connection is part of it. One thread drives every
+ * connection with epoll.
+ */
+#define LOAD_DEFAULT_PORT                   8080
+#define LOAD_DEFAULT_HOST                   "127.0.0.1"
+#define LOAD_DEFAULT_CONNECTIONS            16
+#define LOAD_DEFAULT_DURATION               10
+#define LOAD_MAX_EVENTS                     256
+#define LOAD_HEAD_LENGTH                    8192
+#define LOAD_REPORT_URLS                    20
+
+/* Request to send and when, relative to the start of the run */
+struct load_request {
+    uint64_t at_ns;
+    std::string method, path;
+};
+
+/* Results of one URL */
+struct url_stats {
+    Histogram latency;
+    uint64_t bytes = 0, errors = 0;
+};
+
+enum con_state {
+    CON_CONNECTING,
+    CON_SENDING,
+    CON_READING,
+    CON_IDLE
+};
+
+struct client_con {
+    int fd = -1;
+    con_state state = CON_IDLE;
+    std::string out;
+    size_t out_sent = 0;
+    char head[LOAD_HEAD_LENGTH];
+    size_t head_len = 0;
+    bool head_done = false, until_close = false, keep_alive = false, no_body = false;
+    bool reused = false;                                // request went out on a connection used before
+    uint64_t body_left = 0, bytes = 0, start_ns = 0;
+    url_stats * stats = NULL;
+};
+
+struct load_options {
+    std::string host = LOAD_DEFAULT_HOST, trace, source;
+    int port = LOAD_DEFAULT_PORT, connections = LOAD_DEFAULT_CONNECTIONS;
+    double rate = 0, scale = 1, duration = LOAD_DEFAULT_DURATION;
+    bool http10 = false, closed = false;
+    std::vector<std::string> urls;
+};
+
+static load_options options;
+static std::map<std::string, url_stats *> per_url;
+static url_stats all;
+static std::map<int, uint64_t> statuses;
+static int epoll_fd;
+static struct sockaddr_in server, source;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void print_usage(const char * exec) {
+    printf("\nUSAGE: %s [Options] [path...]\n\n"
+           "Options:\n"
+           "\t-h\t\tPrint a usage summary;\n"
+           "\t-H <address>\tServer address. Default: " LOAD_DEFAULT_HOST ";\n"
+           "\t-p <port>\tServer port. Default: 8080;\n"
+           "\t-b <address>\tConnect from this local address, to look like another client;\n"
+           "\t-c <conns>\tConnections of a closed loop, most connections of an open loop. Default: 16;\n"
+           "\t-r <rate>\tOpen loop with requests per second, paths taken in turn;\n"
+           "\t-f <file>\tReplay paths of a server log, open loop at the logged times unless -C;\n"
+           "\t-x <factor>\tReplay the log factor times faster. Default: 1;\n"
+           "\t-C\t\tClosed loop over the log, ignoring its times;\n"
+           "\t-d <seconds>\tStop after this long. Default: 10, a replayed log runs to its end;\n"
+           "\t-0\t\tUse HTTP/1.0 with a connection per request instead of HTTP/1.1 keep-alive.\n\n"
+           "Paths default to /index.html.\n\n", exec);
+    exit(0);
+}
+
+static void parse_args(int ac, char * av[]) {
+    bool duration = false;
+    for (int i=1; i<ac; i++) {
+        if (av[i][0] != '-') {
+            options.urls.push_back(av[i]);
+            continue;
+        }
+        switch (av[i][1]) {
+            case 'H':
+            if (++i >= ac) print_usage(av[0]);
+            options.host = av[i];
+            break;
+            case 'p':
+            if (++i >= ac) print_usage(av[0]);
+            options.port = atoi(av[i]);
+            break;
+            case 'b':
+            if (++i >= ac) print_usage(av[0]);
+            options.source = av[i];
+            break;
+            case 'c':
+            if (++i >= ac) print_usage(av[0]);
+            options.connections = std::max(atoi(av[i]), 1);
+            break;
+            case 'r':
+            if (++i >= ac) print_usage(av[0]);
+            options.rate = atof(av[i]);
+            break;
+            case 'f':
+            if (++i >= ac) print_usage(av[0]);
+            options.trace = av[i];
+            break;
+            case 'x':
+            if (++i >= ac) print_usage(av[0]);
+            options.scale = atof(av[i]);
+            if (options.scale <= 0) print_usage(av[0]);
+            break;
+            case 'C':
+            options.closed = true;
+            break;
+            case 'd':
+            if (++i >= ac) print_usage(av[0]);
+            options.duration = atof(av[i]);
+            duration = true;
+            break;
+            case '0':
+            options.http10 = true;
+            break;
+            default:
+            print_usage(av[0]);
+        }
+    }
+    if (options.urls.empty()) options.urls.push_back("/index.html");
+    /* Replayed log runs to its end unless told otherwise */
+    if (!options.trace.empty() && !duration) options.duration = 0;
+}
+
+/*
+ * Reads requests from a log written by the server. A line holds the time the
+ * request arrived, with a resolution of a second, and the request line in
+ * quotes. Requests of the same second are spread evenly over it.
+ */
+static std::vector<load_request> read_trace(const std::string & file) {
+    std::ifstream in(file.c_str());
+    if (!in) {
+        perror(file.c_str());
+        exit(1);
+    }
+    std::vector<std::pair<time_t, load_request> > lines;
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t open = line.find('['), close = line.find(']', open), quote = line.find('"');
+        size_t end = line.find('"', quote + 1);
+        if (open == std::string::npos || close == std::string::npos || quote == std::string::npos
+            || end == std::string::npos)
+            continue;
+        struct tm t;
+        memset(&t, 0, sizeof(t));
+        std::string date = line.substr(open + 1, close - open - 1);
+        if (!strptime(date.c_str(), "%d/%b/%Y:%H:%M:%S %z", &t)) continue;
+        time_t at = timegm(&t) - t.tm_gmtoff;
+        std::string request = line.substr(quote + 1, end - quote - 1);
+        size_t space = request.find(' ');
+        if (space == std::string::npos) continue;
+        load_request r;
+        r.method = request.substr(0, space);
+        r.path = request.substr(space + 1, request.find(' ', space + 1) - space - 1);
+        if (r.path.empty() || r.path[0] != '/') continue;
+        lines.push_back(std::make_pair(at, r));
+    }
+    /* Log is written as requests finish, replay goes by arrival */
+    std::stable_sort(lines.begin(), lines.end(),
+                     [](const std::pair<time_t, load_request> & a, const std::pair<time_t, load_request> & b) {
+                         return a.first < b.first;
+                     });
+    std::vector<load_request> trace;
+    for (size_t i=0; i<lines.size(); ) {
+        size_t j = i;
+        while (j < lines.size() && lines[j].first == lines[i].first) j++;
+        for (size_t k=i; k<j; k++) {
+            load_request r = lines[k].second;
+            double offset = (lines[k].first - lines[0].first) + (double) (k - i) / (j - i);
+            r.at_ns = (uint64_t) (offset * 1e9 / options.scale);
+            trace.push_back(r);
+        }
+        i = j;
+    }
+    return trace;
+}
+
+static url_stats * stats_of(const std::string & path) {
+    url_stats *& s = per_url[path];
+    if (!s) s = new url_stats();
+    return s;
+}
+
+static void close_con(client_con * con) {
+    if (con->fd != -1) close(con->fd);
+    con->fd = -1;
+    con->state = CON_IDLE;
+}
+
+/* Opens non-blocking connection to the server. Returns false if the server refuses it */
+static bool open_con(client_con * con) {
+    con->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (con->fd == -1) return false;
+    int one = 1;
+    setsockopt(con->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (!options.source.empty() && bind(con->fd, (struct sockaddr *) &source, sizeof(source)) == -1) {
+        close_con(con);
+        return false;
+    }
+    if (connect(con->fd, (struct sockaddr *) &server, sizeof(server)) == -1 && errno != EINPROGRESS) {
+        close_con(con);
+        return false;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = con;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, con->fd, &ev);
+    con->state = CON_CONNECTING;
+    return true;
+}
+
+/* Starts request on a connection, opening it first if needed. start is the arrival time latency counts from */
+static bool start_request(client_con * con, const load_request & r, uint64_t start) {
+    con->out = r.method + " " + r.path + (options.http10 ? " HTTP/1.0\r\n" : " HTTP/1.1\r\n")
+               + "Host: " + options.host + "\r\n\r\n";
+    con->out_sent = 0;
+    con->head_len = 0;
+    con->head_done = con->until_close = false;
+    con->no_body = r.method == "HEAD";
+    con->body_left = con->bytes = 0;
+    con->start_ns = start;
+    con->stats = stats_of(r.path);
+    con->reused = con->fd != -1;
+    if (con->fd == -1) return open_con(con);
+    con->state = CON_SENDING;
+    return true;
+}
+
+/* Helper method parses response head, returns status or -1 */
+static int parse_head(client_con * con) {
+    int status = -1;
+    if (con->head_len < 12 || strncmp(con->head, "HTTP/1.", 7)) return -1;
+    status = atoi(con->head + 9);
+    con->keep_alive = !options.http10 && con->head[7] == '1';
+    con->until_close = true;
+    for (char * line = strstr(con->head, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n")) {
+        char * name = line + 2;
+        if (!strncasecmp(name, "Content-Length:", 15)) {
+            con->body_left = strtoull(name + 15, NULL, 10);
+            con->until_close = false;
+        }
+        else if (!strncasecmp(name, "Connection:", 11)) {
+            char * value = name + 11;
+            while (*value == ' ') value++;
+            con->keep_alive = !strncasecmp(value, "keep-alive", 10) || (con->keep_alive && strncasecmp(value, "close", 5));
+        }
+    }
+    if (con->no_body || status == 304 || status == 204 || status < 200) {
+        con->body_left = 0;
+        con->until_close = false;
+    }
+    if (con->until_close) con->keep_alive = false;
+    return status;
+}
+
+/* Records finished request, ok is false if the connection failed before the answer was complete */
+static void finish(client_con * con, bool ok, int status) {
+    uint64_t latency = now_ns() - con->start_ns;
+    if (!ok) {
+        con->stats->errors++;
+        all.errors++;
+        close_con(con);
+        return;
+    }
+    con->stats->latency.add(latency);
+    con->stats->bytes += con->bytes;
+    all.latency.add(latency);
+    all.bytes += con->bytes;
+    statuses[status]++;
+    if (con->keep_alive) con->state = CON_IDLE;
+    else close_con(con);
+}
+
+/*
+ * Helper method sends request again on a new connection when a reused one was
+ * closed before any answer, as clients do with an idle keep-alive connection
+ * the server has just closed. Returns false if the request failed.
+ */
+static bool retry(client_con * con) {
+    if (!con->reused || con->bytes) return false;
+    close_con(con);
+    con->reused = false;
+    con->out_sent = 0;
+    return open_con(con);
+}
+
+/*
+ * Moves connection on as far as the socket allows. Returns true when its
+ * request is finished, successfully or not.
+ */
+static bool progress(client_con * con) {
+    static char sink[65536];
+    if (con->state == CON_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(con->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == EINPROGRESS) return false;
+        if (err) {
+            finish(con, false, 0);
+            return true;
+        }
+        con->state = CON_SENDING;
+    }
+    if (con->state == CON_SENDING) {
+        while (con->out_sent < con->out.size()) {
+            ssize_t n = send(con->fd, con->out.data() + con->out_sent, con->out.size() - con->out_sent, MSG_NOSIGNAL);
+            if (n == -1 && errno == EAGAIN) return false;
+            if (n <= 0 && retry(con)) return progress(con);
+            if (n <= 0) {
+                finish(con, false, 0);
+                return true;
+            }
+            con->out_sent += n;
+        }
+        con->state = CON_READING;
+    }
+    if (con->state != CON_READING) return false;
+    int status = 0;
+    while (true) {
+        if (con->head_done && !con->until_close && !con->body_left) {
+            finish(con, true, status ? status : atoi(con->head + 9));
+            return true;
+        }
+        char * to = con->head_done ? sink : con->head + con->head_len;
+        size_t room = con->head_done ? sizeof(sink) : LOAD_HEAD_LENGTH - 1 - con->head_len;
+        ssize_t n = recv(con->fd, to, room, 0);
+        if (n == -1 && errno == EAGAIN) return false;
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            /* Body without a length ends with the connection */
+            bool ok = con->head_done && con->until_close;
+            if (!ok && retry(con)) return progress(con);
+            if (ok) con->keep_alive = false;
+            finish(con, ok, ok ? atoi(con->head + 9) : 0);
+            return true;
+        }
+        con->bytes += n;
+        if (con->head_done) {
+            if (!con->until_close) con->body_left -= std::min<uint64_t>(n, con->body_left);
+            continue;
+        }
+        con->head_len += n;
+        con->head[con->head_len] = '\0';
+        char * end = strstr(con->head, "\r\n\r\n");
+        if (!end) {
+            if (con->head_len == LOAD_HEAD_LENGTH - 1) {
+                finish(con, false, 0);
+                return true;
+            }
+            continue;
+        }
+        con->head_done = true;
+        size_t body = con->head + con->head_len - (end + 4);
+        if ((status = parse_head(con)) < 0) {
+            finish(con, false, 0);
+            return true;
+        }
+        if (!con->until_close) con->body_left -= std::min<uint64_t>(body, con->body_left);
+    }
+}
+
+/* Writes results, the URLs with most requests first */
+static void report(double seconds) {
+    uint64_t done = all.latency.count();
+    printf("requests: %llu in %.2f s, %.0f req/s, %.2f MB/s, %llu errors\n", (unsigned long long) done,
+           seconds, done / seconds, all.bytes / seconds / (1 << 20), (unsigned long long) all.errors);
+    printf("statuses:");
+    for (std::map<int, uint64_t>::iterator it = statuses.begin(); it != statuses.end(); ++it)
+        printf(" %d=%llu", it->first, (unsigned long long) it->second);
+    printf("\n\n%-40s %10s %8s %10s %10s %10s %10s %10s\n", "path", "count", "errors", "mean_ms", "p50_ms",
+           "p99_ms", "p99.9_ms", "max_ms");
+    std::vector<std::pair<uint64_t, std::string> > order;
+    for (std::map<std::string, url_stats *>::iterator it = per_url.begin(); it != per_url.end(); ++it)
+        order.push_back(std::make_pair(it->second->latency.count() + it->second->errors, it->first));
+    std::sort(order.rbegin(), order.rend());
+    std::vector<std::pair<std::string, url_stats *> > rows;
+    for (size_t i=0; i<order.size() && i<LOAD_REPORT_URLS; i++)
+        rows.push_back(std::make_pair(order[i].second, per_url[order[i].second]));
+    rows.push_back(std::make_pair(std::string("all"), &all));
+    for (size_t i=0; i<rows.size(); i++) {
+        const Histogram & h = rows[i].second->latency;
+        printf("%-40.40s %10llu %8llu %10.3f %10.3f %10.3f %10.3f %10.3f\n", rows[i].first.c_str(),
+               (unsigned long long) h.count(), (unsigned long long) rows[i].second->errors, h.mean() / 1e6,
+               h.percentile(50) / 1e6, h.percentile(99) / 1e6, h.percentile(99.9) / 1e6, h.max() / 1e6);
+    }
+}
+
+int main(int argc, char * argv[]) {
+    parse_args(argc, argv);
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.host.c_str(), &server.sin_addr) != 1) print_usage(argv[0]);
+    memset(&source, 0, sizeof(source));
+    source.sin_family = AF_INET;
+    if (!options.source.empty() && inet_pton(AF_INET, options.source.c_str(), &source.sin_addr) != 1)
+        print_usage(argv[0]);
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll");
+        return 1;
+    }
+    /* Requests come from the log or go through the paths in turn */
+    std::vector<load_request> trace;
+    if (!options.trace.empty() && (trace = read_trace(options.trace)).empty()) {
+        fprintf(stderr, "no requests in %s\n", options.trace.c_str());
+        return 1;
+    }
+    bool open_loop = options.rate > 0 || (!trace.empty() && !options.closed);
+    size_t next = 0;
+    uint64_t interval = options.rate > 0 ? (uint64_t) (1e9 / options.rate) : 0;
+    auto request_at = [&](size_t i, load_request & r) -> bool {
+        if (!trace.empty()) {
+            if (i >= trace.size()) return false;
+            r = trace[i];
+            if (options.rate > 0) r.at_ns = i * interval;
+            return true;
+        }
+        r.method = "GET";
+        r.path = options.urls[i % options.urls.size()];
+        r.at_ns = i * interval;
+        return true;
+    };
+
+    std::vector<client_con> cons(options.connections);
+    std::vector<client_con *> idle;
+    for (int i=options.connections-1; i>=0; i--) idle.push_back(&cons[i]);
+    std::deque<std::pair<load_request, uint64_t> > waiting;      // open loop arrivals without a connection
+    uint64_t start = now_ns(), stop = options.duration > 0 ? start + (uint64_t) (options.duration * 1e9) : 0;
+    size_t in_flight = 0;
+    bool more = true;
+    struct epoll_event events[LOAD_MAX_EVENTS];
+    while (true) {
+        uint64_t now = now_ns();
+        if (stop && now >= stop) break;
+        /* Closed loop refills every free connection, open loop takes arrivals that are due */
+        load_request r;
+        if (!open_loop) {
+            while (more && !idle.empty() && (more = request_at(next, r))) {
+                client_con * con = idle.back();
+                idle.pop_back();
+                next++;
+                if (!start_request(con, r, now_ns())) {
+                    fprintf(stderr, "cannot connect to %s:%d\n", options.host.c_str(), options.port);
+                    return 1;
+                }
+                progress(con) ? idle.push_back(con) : (void) in_flight++;
+            }
+        }
+        else {
+            while (more && (more = request_at(next, r)) && start + r.at_ns <= now) {
+                waiting.push_back(std::make_pair(r, start + r.at_ns));
+                next++;
+            }
+            while (!waiting.empty() && !idle.empty()) {
+                client_con * con = idle.back();
+                idle.pop_back();
+                if (!start_request(con, waiting.front().first, waiting.front().second)) {
+                    fprintf(stderr, "cannot connect to %s:%d\n", options.host.c_str(), options.port);
+                    return 1;
+                }
+                waiting.pop_front();
+                progress(con) ? idle.push_back(con) : (void) in_flight++;
+            }
+        }
+        if (!more && !in_flight && waiting.empty()) break;
+        /* Sleep until the next arrival of an open loop at most */
+        int timeout = -1;
+        if (open_loop && more) {
+            uint64_t due = start + r.at_ns;
+            timeout = due > now_ns() ? (int) ((due - now_ns() + 999999) / 1000000) : 0;
+        }
+        if (stop) {
+            int left = (int) ((stop - std::min(stop, now_ns()) + 999999) / 1000000);
+            timeout = timeout < 0 ? left : std::min(timeout, left);
+        }
+        int n = epoll_wait(epoll_fd, events, LOAD_MAX_EVENTS, timeout);
+        for (int i=0; i<n; i++) {
+            client_con * con = (client_con *) events[i].data.ptr;
+            if (con->fd != -1 && con->state != CON_IDLE && progress(con)) {
+                idle.push_back(con);
+                in_flight--;
+            }
+        }
+    }
+    report((now_ns() - start) / 1e9);
+    return 0;
+}
@@ -0,0 +1,177 @@
+
+#include "cache.h"
+#include "index.h"
+
+
+FileCache::FileCache(const char * n, size_t bytes) : name(n), capacity(bytes), hits(0), misses(0),
+    evictions(0), invalidations(0) {}
+
+/* Sets byte budget, called before workers start. 0 disables the cache */
+void FileCache::set_capacity(size_t bytes) {
+    capacity = bytes;
+}
+
+FileCache::shard & FileCache::shard_for(const std::string & path) {
+    return shards[std::hash<std::string>()(path) % CACHE_SHARDS];
+}
+
+/* Returns cached file or its metadata or NULL. Does no system calls unless entry is due for a check */
+std::shared_ptr<cache_entry> FileCache::lookup(const std::string & path) {
+    std::shared_ptr<cache_entry> entry;
+    if (!capacity) return entry;
+    shard & sh = shard_for(path);
+    std::unique_lock<std::mutex> lock(sh.m);
+    /****************** Critical section ****************/
+    auto it = sh.index.find(path);
+    if (it != sh.index.end()) {
+        entry = *it->second;
+        sh.lru.splice(sh.lru.begin(), sh.lru, it->second);
+    }
+    /****************************************************/
+    lock.unlock();
+    if (entry && !is_fresh(entry.get())) {
+        lock.lock();
+        erase(sh, path, entry.get());
+        lock.unlock();
+        invalidations++;
+        entry.reset();
+    }
+    if (entry) hits++;
+    else misses++;
+    return entry;
+}
+
+/*
+ * Helper method checks whether cached copy still matches the file on disk. A
+ * file the path index knows is checked against it on every hit, as that needs
+ * no system call; others are checked with stat() once in a while.
+ */
+bool FileCache::is_fresh(cache_entry * entry) {
+    struct stat f_info;
+    if (!path_index.find_stat(entry->path, f_info)) {
+        time_t now = server_clock.now();
+        if (now - entry->checked.load(std::memory_order_relaxed) < CACHE_REVALIDATE_INTERVAL)
+            return true;
+        if (stat(entry->path.c_str(), &f_info)) return false;
+        entry->checked.store(now, std::memory_order_relaxed);
+    }
+    return (f_info.st_mode & S_IFMT) == entry->type && (size_t) f_info.st_size == entry->file_size
+           && f_info.st_mtime == entry->mtime && f_info.st_mtim.tv_nsec == entry->mtime_ns
+           && f_info.st_ino == entry->ino;
+}
+
+/* Helper method creates entry for the file at path without data */
+std::shared_ptr<cache_entry> FileCache::make_entry(const std::string & key, const std::string & path,
+                                                   const struct stat & f_info, extension content_type) {
+    std::shared_ptr<cache_entry> entry = std::make_shared<cache_entry>();
+    entry->key = key;
+    entry->path = path;
+    entry->size = entry->file_size = f_info.st_size;
+    entry->charge = CACHE_METADATA_COST;
+    entry->mtime = f_info.st_mtime;
+    entry->mtime_ns = f_info.st_mtim.tv_nsec;
+    entry->ino = f_info.st_ino;
+    entry->type = f_info.st_mode & S_IFMT;
+    entry->content_type = content_type;
+    format_http_date(entry->mtime, entry->last_modified);
+    entry->checked.store(server_clock.now(), std::memory_order_relaxed);
+    return entry;
+}
+
+/*
+ * Reads file from the open descriptor into a new entry stored under key. A file
+ * too big to be cached gets an entry with metadata only. Returns NULL if the
+ * file could not be read completely.
+ */
+std::shared_ptr<cache_entry> FileCache::insert(const std::string & key, const std::string & path, int fd,
+                                               const struct stat & f_info, extension content_type) {
+    std::shared_ptr<cache_entry> entry;
+    if (!capacity) return entry;
+    entry = make_entry(key, path, f_info, content_type);
+    size_t size = entry->size;
+    if (size <= CACHE_MAX_ENTRY_SIZE && size <= capacity / CACHE_SHARDS) {
+        entry->data = new char[size];
+        entry->charge = size;
+        for (size_t done = 0; done < size; ) {
+            ssize_t got = pread(fd, entry->data + done, size - done, done);
+            if (got == -1 && errno == EINTR) continue;
+            if (got <= 0) return std::shared_ptr<cache_entry>();
+            done += got;
+        }
+    }
+    store(entry);
+    return entry;
+}
+
+/*
+ * Stores bytes derived from the file at path, e.g. its compressed copy, under
+ * key. The entry is valid while the file matches f_info. Takes ownership of
+ * data if it returns the entry, returns NULL if the bytes do not fit into the
+ * cache.
+ */
+std::shared_ptr<cache_entry> FileCache::insert_bytes(const std::string & key, const std::string & path,
+                                                     char * data, size_t size, const struct stat & f_info,
+                                                     extension content_type) {
+    std::shared_ptr<cache_entry> entry;
+    if (size > CACHE_MAX_ENTRY_SIZE || size > capacity / CACHE_SHARDS)
+        return entry;
+    entry = make_entry(key, path, f_info, content_type);
+    entry->data = data;
+    entry->size = entry->charge = size;
+    store(entry);
+    return entry;
+}
+
+/* Helper method puts entry into its shard, replacing an older one with the same key */
+void FileCache::store(std::shared_ptr<cache_entry> & entry) {
+    shard & sh = shard_for(entry->key);
+    std::lock_guard<std::mutex> lg(sh.m);
+    /****************** Critical section ****************/
+    auto it = sh.index.find(entry->key);
+    if (it != sh.index.end()) erase(sh, entry->key, it->second->get());
+    sh.lru.push_front(entry);
+    sh.index[entry->key] = sh.lru.begin();
+    sh.bytes += entry->charge;
+    /* Evict least recently used entries until shard fits into its budget */
+    while (sh.bytes > capacity / CACHE_SHARDS) {
+        std::shared_ptr<cache_entry> & victim = sh.lru.back();
+        sh.bytes -= victim->charge;
+        sh.index.erase(victim->key);
+        sh.lru.pop_back();
+        evictions++;
+    }
+    /****************************************************/
+}
+
+/* Returns size of a cached file or -1, without system calls or touching the LRU order */
+off_t FileCache::size_hint(const std::string & key) {
+    if (!capacity) return -1;
+    shard & sh = shard_for(key);
+    std::lock_guard<std::mutex> lg(sh.m);
+    auto it = sh.index.find(key);
+    return it == sh.index.end() ? -1 : (*it->second)->size;
+}
+
+/* Removes entry from shard if it is still the one cached for path. Shard must be locked */
+void FileCache::erase(shard & sh, const std::string & path, const cache_entry * entry) {
+    auto it = sh.index.find(path);
+    if (it == sh.index.end() || it->second->get() != entry) return;
+    sh.bytes -= entry->charge;
+    sh.lru.erase(it->second);
+    sh.index.erase(it);
+}
+
+/* Returns counters as a single line */
+std::string FileCache::stats() {
+    size_t entries = 0, bytes = 0;
+    for (int i=0; i<CACHE_SHARDS; i++) {
+        std::lock_guard<std::mutex> lg(shards[i].m);
+        entries += shards[i].index.size();
+        bytes += shards[i].bytes;
+    }
+    std::stringstream out;
+    out << name << ": entries=" << entries << " bytes=" << bytes << " capacity=" << capacity
+        << " hits=" << hits << " misses=" << misses << " evictions=" << evictions
+        << " invalidations=" << invalidations << '\n';
+    return out.str();
+}
@@ -0,0 +1,78 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "myhttpd.h"
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+/* Cache settings */
+#define CACHE_SHARDS                        16
+#define CACHE_MAX_ENTRY_SIZE                (1 << 20)
+#define CACHE_REVALIDATE_INTERVAL           1       // seconds between stat() of a cached file
+#define CACHE_METADATA_COST                 256     // bytes charged for an entry without file bytes
+
+/* File bytes together with metadata needed to answer a request. Large files have metadata only */
+struct cache_entry {
+    std::string key, path;                              // requested path and file it resolved to
+    char * data = NULL;
+    size_t size, charge;
+    size_t file_size;                                   // size of the file at path, data may differ
+    time_t mtime;
+    long mtime_ns;                                      // catches changes within the same second
+    ino_t ino;
+    mode_t type;                                        // regular file, or directory for a listing
+    extension content_type;
+    char last_modified[HTTP_DATE_LENGTH + 1];
+    std::atomic<time_t> checked;
+    ~cache_entry() { delete [] data; }
+};
+
+/*
+ * Sharded LRU cache of small files keyed by normalized path. Files too large
+ * to hold are kept as metadata, so their size and type are known without stat(). Every shard has
+ * its own mutex and an equal part of the byte budget. Entries are shared
+ * pointers, so an entry evicted while a worker still sends it stays alive
+ * until the send is done. A cached file is checked with stat() at most once
+ * per CACHE_REVALIDATE_INTERVAL and dropped if its size, mtime or inode changed.
+ * Rendered directory listings are kept the same way and checked against the
+ * directory.
+ */
+class FileCache {
+public:
+    FileCache(const char *, size_t);
+    void set_capacity(size_t);
+    std::shared_ptr<cache_entry> lookup(const std::string &);
+    std::shared_ptr<cache_entry> insert(const std::string &, const std::string &, int,
+                                        const struct stat &, extension);
+    std::shared_ptr<cache_entry> insert_bytes(const std::string &, const std::string &, char *, size_t,
+                                              const struct stat &, extension);
+    off_t size_hint(const std::string &);
+    std::string stats();
+private:
+    typedef std::list<std::shared_ptr<cache_entry>> lru_list;
+
+    struct shard {
+        std::mutex m;
+        lru_list lru;                                   // most recently used first
+        std::unordered_map<std::string, lru_list::iterator> index;
+        size_t bytes = 0;
+    };
+
+    shard & shard_for(const std::string &);
+    std::shared_ptr<cache_entry> make_entry(const std::string &, const std::string &,
+                                            const struct stat &, extension);
+    void store(std::shared_ptr<cache_entry> &);
+    bool is_fresh(cache_entry *);
+    void erase(shard &, const std::string &, const cache_entry *);
+
+    shard shards[CACHE_SHARDS];
+    const char * name;
+    size_t capacity;
+    std::atomic<unsigned long> hits, misses, evictions, invalidations;
+};
+
+extern FileCache file_cache;
+
+
+#endif
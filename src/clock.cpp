@@ -0,0 +1,51 @@
+
+#include "clock.h"
+#include <thread>
+
+
+ServerClock::ServerClock() : seconds(0) {
+    refresh();
+}
+
+/* Starts the timer thread */
+void ServerClock::start() {
+    std::thread(&ServerClock::run, this).detach();
+}
+
+/* Sleeps until the next whole second and refreshes cached values */
+void ServerClock::run() {
+    while (true) {
+        struct timespec next;
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec++;
+        next.tv_nsec = 0;
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL)) {}
+        refresh();
+    }
+}
+
+/* Reads the fine clock, as time() may still give the previous second right after the boundary */
+void ServerClock::refresh() {
+    char buf[HTTP_DATE_LENGTH + 1];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_t now = ts.tv_sec;
+    format_http_date(now, buf);
+    date.store(buf, HTTP_DATE_LENGTH);
+    seconds.store(now, std::memory_order_relaxed);
+}
+
+/* Helper method writes UNIX timestamp in HTTP date format, out must hold HTTP_DATE_LENGTH + 1 bytes */
+void format_http_date(time_t stamp, char * out) {
+    struct tm t;
+    strftime(out, HTTP_DATE_LENGTH + 1, "%a, %d %h %Y %T GMT", gmtime_r(&stamp, &t));
+}
+
+/* Helper method reads date in HTTP format back into UNIX timestamp, returns -1 if it is not one */
+time_t parse_http_date(const char * text) {
+    struct tm t;
+    memset(&t, 0, sizeof(t));
+    const char * end = strptime(text, "%a, %d %b %Y %T GMT", &t);
+    if (!end || *end) return -1;
+    return timegm(&t);
+}
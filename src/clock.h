@@ -0,0 +1,84 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <time.h>
+
+/* Length of "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define HTTP_DATE_LENGTH                    29
+#define TIME_TEXT_WORDS                     4
+
+/*
+ * Short text that changes rarely and is read by many threads. Writer is
+ * single; readers copy it out under a sequence lock and retry if a write
+ * happened in between. Text is kept in atomic words so copies never race.
+ */
+class TimeText {
+public:
+    TimeText() : seq(0) {
+        for (int i=0; i<TIME_TEXT_WORDS; i++) words[i].store(0, std::memory_order_relaxed);
+    }
+
+    void store(const char * text, size_t len) {
+        uint64_t buf[TIME_TEXT_WORDS] = {0};
+        memcpy(buf, text, std::min(len, sizeof(buf)));
+        unsigned s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (int i=0; i<TIME_TEXT_WORDS; i++) words[i].store(buf[i], std::memory_order_relaxed);
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    /* Copies len bytes of the text into out */
+    void load(char * out, size_t len) const {
+        uint64_t buf[TIME_TEXT_WORDS];
+        unsigned s1, s2;
+        do {
+            s1 = seq.load(std::memory_order_acquire);
+            for (int i=0; i<TIME_TEXT_WORDS; i++) buf[i] = words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            s2 = seq.load(std::memory_order_relaxed);
+        } while ((s1 & 1) || s1 != s2);
+        memcpy(out, buf, std::min(len, sizeof(buf)));
+    }
+
+private:
+    std::atomic<unsigned> seq;
+    std::atomic<uint64_t> words[TIME_TEXT_WORDS];
+};
+
+/*
+ * Wall clock with second resolution. A timer thread wakes up at every whole
+ * second and re-renders the values that go into every response, so request
+ * paths only copy them.
+ */
+class ServerClock {
+public:
+    ServerClock();
+    void start();
+    time_t now() const { return seconds.load(std::memory_order_relaxed); }
+    void http_date(char * out) const { date.load(out, HTTP_DATE_LENGTH); }
+private:
+    void run();
+    void refresh();
+    std::atomic<time_t> seconds;
+    TimeText date;
+};
+
+void format_http_date(time_t, char *);
+time_t parse_http_date(const char *);
+
+/* Nanoseconds on the monotonic clock, for measuring intervals */
+inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+extern ServerClock server_clock;
+
+
+#endif
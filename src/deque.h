@@ -0,0 +1,68 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <atomic>
+#include <cstddef>
+
+#define CACHE_LINE_SIZE                     64
+
+/*
+ * Bounded lock-free work-stealing deque (Chase-Lev). Only the owning worker
+ * pushes at the bottom; the owner and thieves take from the top with a CAS,
+ * so items leave in the order they were pushed. This keeps the priority order
+ * of a batch taken from the request queue no matter which worker runs it.
+ * N must be a power of two.
+ */
+template <typename T, size_t N>
+class StealingDeque {
+public:
+    StealingDeque() : top(0), bottom(0) {
+        for (size_t i=0; i<N; i++) buf[i].store(T(), std::memory_order_relaxed);
+    }
+
+    /* Owner only. Returns false if deque is full */
+    bool push(T item) {
+        size_t b = bottom.load(std::memory_order_relaxed);
+        size_t t = top.load(std::memory_order_acquire);
+        if (b - t >= N) return false;
+        buf[b & (N - 1)].store(item, std::memory_order_relaxed);
+        /* Item must be visible before thieves can see new bottom */
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Any thread. Returns false if deque is empty */
+    bool steal(T & item) {
+        size_t t = top.load(std::memory_order_acquire);
+        while (true) {
+            size_t b = bottom.load(std::memory_order_acquire);
+            if (t >= b) return false;
+            item = buf[t & (N - 1)].load(std::memory_order_relaxed);
+            /* On failure t is reloaded with the current top and we retry */
+            if (top.compare_exchange_weak(t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_acquire))
+                return true;
+        }
+    }
+
+    /* Any thread, approximate while other threads push or steal */
+    size_t size() const {
+        size_t t = top.load(std::memory_order_relaxed), b = bottom.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+
+    bool empty() const {
+        return top.load(std::memory_order_seq_cst) >= bottom.load(std::memory_order_seq_cst);
+    }
+
+private:
+    /* Top and bottom are written by different threads, keep them on separate lines */
+    std::atomic<size_t> top;
+    char pad_top[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> bottom;
+    char pad_bottom[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<T> buf[N];
+};
+
+
+#endif
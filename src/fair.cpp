@@ -0,0 +1,131 @@
+
+#include "fair.h"
+
+
+FairQueue::FairQueue(int prefix, unsigned c) : mask(prefix >= 32 ? ~0u : ~(~0u >> prefix)), cap(c),
+    queued(0), backlogged(0) {}
+
+/* Queues request behind the other requests of its client */
+void FairQueue::push(http_request * req) {
+    uint32_t key = req->client_addr & mask;
+    std::unordered_map<uint32_t, fair_client *>::iterator it = clients.find(key);
+    fair_client * c;
+    if (it != clients.end()) c = it->second;
+    else {
+        if (clients.size() >= FAIR_MAX_CLIENTS) forget_idle();
+        c = new fair_client();
+        c->key = key;
+        clients[key] = c;
+    }
+    req->fair = c;
+    if (c->requests.empty()) backlogged++;
+    c->requests.push(req);
+    queued++;
+    enlist(c);
+}
+
+/*
+ * Returns next request in round robin order, or NULL if no client may be
+ * served. Client whose deficit does not cover its next request ends its turn
+ * and the next one gets a quantum; requests cost at most FAIR_MAX_COST, so a
+ * turn is found within a few rounds.
+ */
+http_request * FairQueue::pop() {
+    while (!round.empty()) {
+        fair_client * c = round.front();
+        http_request * req = c->requests.top();
+        int64_t bytes = cost(req);
+        if (c->deficit < bytes) {
+            round.pop_front();
+            round.push_back(c);
+            round.front()->deficit += FAIR_QUANTUM;
+            continue;
+        }
+        c->requests.pop();
+        c->deficit -= bytes;
+        c->in_flight++;
+        c->served++;
+        queued--;
+        /* Client without requests does not save its deficit, one at its cap keeps it */
+        if (c->requests.empty()) {
+            backlogged--;
+            c->deficit = 0;
+        }
+        if (c->requests.empty() || (cap && c->in_flight >= cap)) {
+            round.pop_front();
+            c->listed = false;
+        }
+        return req;
+    }
+    return NULL;
+}
+
+/* Takes up to n requests into out, fewer if every client left is at its cap. Returns number taken */
+int FairQueue::pop(http_request ** out, int n) {
+    int taken = 0;
+    while (taken < n && (out[taken] = pop())) taken++;
+    return taken;
+}
+
+/* Counts request of client as finished or put back. Returns true if the client may be served again */
+bool FairQueue::finished(fair_client * c) {
+    c->in_flight--;
+    bool listed = c->listed;
+    enlist(c);
+    return c->listed && !listed;
+}
+
+/*
+ * Checks whether client of request holds less than an equal share of limit
+ * queued requests, counting it among the clients that have requests.
+ */
+bool FairQueue::under_share(const http_request * req, size_t limit) {
+    std::unordered_map<uint32_t, fair_client *>::iterator it = clients.find(req->client_addr & mask);
+    size_t mine = it == clients.end() ? 0 : it->second->requests.size();
+    size_t share = limit / (backlogged + !mine);
+    return mine < std::max<size_t>(share, 1);
+}
+
+/* Appends load of every client that has requests queued or being served */
+void FairQueue::loads(std::vector<client_load> & out) {
+    for (std::unordered_map<uint32_t, fair_client *>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        fair_client * c = it->second;
+        if (c->requests.empty() && !c->in_flight) continue;
+        client_load load = {c->key, c->requests.size(), c->in_flight, c->served};
+        out.push_back(load);
+    }
+}
+
+/* Helper method returns bytes a request is charged, its expected response with a fixed cost on top */
+int64_t FairQueue::cost(const http_request * req) {
+    return std::min<int64_t>(SchedulingPolicy::remaining_bytes(req) + FAIR_REQUEST_COST, FAIR_MAX_COST);
+}
+
+/* Helper method puts client into the round if it has requests and is under its cap */
+void FairQueue::enlist(fair_client * c) {
+    if (c->listed || c->requests.empty() || (cap && c->in_flight >= cap)) return;
+    c->listed = true;
+    round.push_back(c);
+}
+
+/* Helper method drops clients with nothing queued or served, they are kept until the table fills up */
+void FairQueue::forget_idle() {
+    for (std::unordered_map<uint32_t, fair_client *>::iterator it = clients.begin(); it != clients.end(); ) {
+        if (it->second->requests.empty() && !it->second->in_flight) {
+            delete it->second;
+            it = clients.erase(it);
+        }
+        else ++it;
+    }
+}
+
+/* Returns client key as an address, with the prefix length if it is a subnet */
+std::string client_name(uint32_t key, int prefix) {
+    char text[INET_ADDRSTRLEN + 4];
+    struct in_addr addr;
+    addr.s_addr = htonl(key);
+    inet_ntop(AF_INET, &addr, text, INET_ADDRSTRLEN);
+    std::string name = text;
+    if (prefix < 32) name += "/" + std::to_string(prefix);
+    return name;
+}
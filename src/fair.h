@@ -0,0 +1,71 @@
+#ifndef FAIR_H
+#define FAIR_H
+
+#include "myhttpd.h"
+#include "policy.h"
+#include <unordered_map>
+#include <deque>
+
+/* Fair queuing settings */
+#define FAIR_QUANTUM                        (64 << 10)  // bytes a client may be served per round
+#define FAIR_REQUEST_COST                   (4 << 10)   // bytes charged for a request on top of its size
+#define FAIR_MAX_COST                       (16 * FAIR_QUANTUM)
+#define FAIR_MAX_CLIENTS                    4096        // idle clients are forgotten beyond this many
+#define FAIR_REPORT_CLIENTS                 10
+
+typedef std::priority_queue<http_request *, std::vector<http_request *>, request_order> http_request_queue;
+
+/* Requests of one client (an address or a subnet) and its state in the round */
+struct fair_client {
+    uint32_t key;
+    http_request_queue requests;                        // in the order of the scheduling policy
+    int64_t deficit = 0;                                // bytes it may be served before its turn ends
+    unsigned in_flight = 0;                             // taken by workers and not finished
+    unsigned long served = 0;
+    bool listed = false;                                // in the round
+};
+
+/* Load of one client, for the status page */
+struct client_load {
+    uint32_t key;
+    size_t queued;
+    unsigned in_flight;
+    unsigned long served;
+};
+
+/*
+ * Deficit round robin over clients keyed by address prefix. Every client has
+ * its own queue ordered by the scheduling policy, and clients with requests
+ * take turns: a turn adds FAIR_QUANTUM to the client's deficit and serves its
+ * requests while the deficit covers their size, so each backlogged client gets
+ * an equal share of bytes whatever its request rate. A client with cap
+ * requests taken by workers sits out of the round until one finishes. Not
+ * thread safe, the pool calls it under its queue mutex.
+ */
+class FairQueue {
+public:
+    FairQueue(int, unsigned);
+    void push(http_request *);
+    http_request * pop();
+    int pop(http_request **, int);
+    bool finished(fair_client *);
+    bool under_share(const http_request *, size_t);
+    bool empty() const { return round.empty(); }
+    size_t size() const { return queued; }
+    void loads(std::vector<client_load> &);
+private:
+    int64_t cost(const http_request *);
+    void enlist(fair_client *);
+    void forget_idle();
+
+    uint32_t mask;
+    unsigned cap;
+    std::unordered_map<uint32_t, fair_client *> clients;
+    std::deque<fair_client *> round;                    // clients that may be served, front has the turn
+    size_t queued, backlogged;                          // requests, and clients having any
+};
+
+std::string client_name(uint32_t, int);
+
+
+#endif
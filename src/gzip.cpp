@@ -0,0 +1,135 @@
+
+#include "gzip.h"
+#include <zlib.h>
+
+
+/*
+ * Checks Accept-Encoding for gzip. An explicit "gzip" or "x-gzip" wins over
+ * "*", and a coding with q=0 is refused.
+ */
+bool accepts_gzip(str_view header) {
+    int gzip = -1, any = -1;
+    const char * p = header.data, * end = header.data + header.len;
+    while (p < end) {
+        const char * comma = (const char *) memchr(p, ',', end - p);
+        if (!comma) comma = end;
+        while (p < comma && (*p == ' ' || *p == '\t')) p++;
+        const char * name_end = p;
+        while (name_end < comma && *name_end != ';' && *name_end != ' ' && *name_end != '\t') name_end++;
+        str_view coding(p, name_end - p);
+        /* Only q=0, q=0.0 and alike refuse a coding */
+        bool refused = false;
+        for (const char * param = (const char *) memchr(name_end, ';', comma - name_end); param;
+             param = (const char *) memchr(param + 1, ';', comma - param - 1)) {
+            const char * v = param + 1;
+            while (v < comma && (*v == ' ' || *v == '\t')) v++;
+            if (comma - v < 2 || (*v != 'q' && *v != 'Q') || v[1] != '=') continue;
+            refused = true;
+            for (v += 2; v < comma && *v != ';' && *v != ' ' && *v != '\t'; v++)
+                if (*v != '0' && *v != '.') refused = false;
+        }
+        if (coding.equals("gzip") || coding.equals("x-gzip")) gzip = !refused;
+        else if (coding.equals("*")) any = !refused;
+        p = comma + 1;
+    }
+    return gzip != -1 ? gzip : any == 1;
+}
+
+/* Compresses size bytes into a new gzip buffer and stores its length in out_size. Returns NULL on failure */
+char * gzip_compress(const char * data, size_t size, size_t & out_size) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    /* Window bits above 15 ask for a gzip header and trailer instead of zlib ones */
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    size_t bound = deflateBound(&zs, size) + 32;
+    char * out = new char[bound];
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = size;
+    zs.next_out = (Bytef *) out;
+    zs.avail_out = bound;
+    int rc = deflate(&zs, Z_FINISH);
+    out_size = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        delete [] out;
+        return NULL;
+    }
+    return out;
+}
+
+/* Helper method finds or makes compressed variant of the size bytes of body at path */
+static std::shared_ptr<cache_entry> load_variant(const std::string & key, const std::string & path, size_t size,
+                                                 const struct stat & f_info, http_response & resp) {
+    std::shared_ptr<cache_entry> variant;
+    /* Sibling .gz file prepared in advance wins over compressing, unless it is older; listings have none */
+    std::string gz_path = path + GZIP_SUFFIX;
+    struct stat gz_info;
+    if (!S_ISDIR(f_info.st_mode) && !stat(gz_path.c_str(), &gz_info) && S_ISREG(gz_info.st_mode)
+        && gz_info.st_mtime >= f_info.st_mtime) {
+        int fd = open(gz_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return variant;
+        variant = gzip_cache.insert(key, gz_path, fd, gz_info, resp.content_type);
+        close(fd);
+        return variant;
+    }
+    if (size > GZIP_MAX_SIZE) return variant;
+    /* File bytes come from the file cache if they are there */
+    std::vector<char> copy;
+    const char * data = resp.cached ? resp.cached->data : NULL;
+    if (!data) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return variant;
+        copy.resize(size);
+        size_t done = 0;
+        while (done < size) {
+            ssize_t got = pread(fd, copy.data() + done, size - done, done);
+            if (got == -1 && errno == EINTR) continue;
+            if (got <= 0) break;
+            done += got;
+        }
+        close(fd);
+        if (done < size) return variant;
+        data = copy.data();
+    }
+    size_t gz_size;
+    char * gz = gzip_compress(data, size, gz_size);
+    if (gz && !(variant = gzip_cache.insert_bytes(key, path, gz, gz_size, f_info, resp.content_type)))
+        delete [] gz;
+    return variant;
+}
+
+/*
+ * Replaces body of a 200 response with its gzip variant if the type is worth
+ * compressing and the client accepts gzip: a .gz file next to the original or
+ * a copy compressed once and kept in gzip_cache under path and mtime. Every
+ * response of such a type says Vary, compressed or not.
+ */
+void negotiate_gzip(http_request * req, http_response & resp, const std::string & path,
+                    const struct stat & f_info) {
+    /* Body of a listing is its rendered page in the cache, not the directory */
+    size_t size = resp.cached && resp.cached->data ? resp.cached->size : f_info.st_size;
+    if (resp.content_type != HTML || size < GZIP_MIN_SIZE)
+        return;
+    resp.vary = true;
+    if (!req->parsed || !accepts_gzip(req->parsed->find("Accept-Encoding")))
+        return;
+    /* Key is built in a buffer of the thread that keeps its capacity */
+    static thread_local std::string key;
+    char mtime[24];
+    key.assign(req->norm_path).append(1, '@').append(mtime, snprintf(mtime, sizeof(mtime), "%lld", (long long) f_info.st_mtime));
+    std::shared_ptr<cache_entry> variant = gzip_cache.lookup(key);
+    if (!variant && !(variant = load_variant(key, path, size, f_info, resp)))
+        return;
+    /* Large .gz file is only known by metadata and is sent from disk */
+    int fd = -1;
+    if (!variant->data && !resp.head && (fd = open(variant->path.c_str(), O_RDONLY | O_CLOEXEC)) == -1)
+        return;
+    if (resp.file_fd != -1) close(resp.file_fd);
+    resp.file_fd = fd;
+    resp.cached = variant;
+    /* Entry of a .gz file has the mtime of that file, the header shows the original one */
+    resp.last_modified = variant->mtime == resp.mod_time ? variant->last_modified : NULL;
+    if (!resp.head) resp.content_length = variant->size;
+    resp.gzip = true;
+}
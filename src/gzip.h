@@ -0,0 +1,21 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include "myhttpd.h"
+#include "cache.h"
+
+/* Compression settings */
+#define GZIP_MIN_SIZE                       1024            // smaller bodies are sent as they are
+#define GZIP_MAX_SIZE                       CACHE_MAX_ENTRY_SIZE // larger ones only from a .gz file
+#define GZIP_LEVEL                          6
+#define GZIP_SUFFIX                         ".gz"
+
+bool accepts_gzip(str_view);
+char * gzip_compress(const char *, size_t, size_t &);
+void negotiate_gzip(http_request *, http_response &, const std::string &, const struct stat &);
+
+/* Compressed variants keyed by requested path and mtime, defined in myhttpd.cpp */
+extern FileCache gzip_cache;
+
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+/*
+ * Log-linear histogram of non-negative values (nanoseconds, bytes). Values
+ * below 16 get a bucket each, larger ones are bucketed by power of two split
+ * into 8 linear sub-buckets, so a reported percentile is within 12.5% of the
+ * true value. Recording takes relaxed atomic operations only, a histogram
+ * owned by one thread is updated with plain loads and stores.
+ */
+#define HISTOGRAM_LINEAR                    16
+#define HISTOGRAM_SUB_BITS                  3
+#define HISTOGRAM_BUCKETS                   (HISTOGRAM_LINEAR + (64 - 4) * (1 << HISTOGRAM_SUB_BITS))
+
+class Histogram {
+public:
+    Histogram() : total(0), sum(0), max_value(0) {
+        for (int i=0; i<HISTOGRAM_BUCKETS; i++) counts[i].store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t value) {
+        counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t seen = max_value.load(std::memory_order_relaxed);
+        while (value > seen && !max_value.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+    }
+
+    /* Same as record() for a histogram written by one thread only, without locked instructions */
+    void add(uint64_t value) {
+        bump(counts[bucket(value)], 1);
+        bump(total, 1);
+        bump(sum, value);
+        if (value > max_value.load(std::memory_order_relaxed)) max_value.store(value, std::memory_order_relaxed);
+    }
+
+    /* Adds counts of another histogram, used to combine per-thread histograms */
+    void merge(const Histogram & other) {
+        for (int i=0; i<HISTOGRAM_BUCKETS; i++)
+            counts[i].fetch_add(other.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        total.fetch_add(other.count(), std::memory_order_relaxed);
+        sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        uint64_t value = other.max(), seen = max_value.load(std::memory_order_relaxed);
+        while (value > seen && !max_value.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_value.load(std::memory_order_relaxed); }
+    uint64_t mean() const { return count() ? sum.load(std::memory_order_relaxed) / count() : 0; }
+
+    /* Returns upper bound of the bucket holding the given percentile (0-100) */
+    uint64_t percentile(double p) const {
+        uint64_t n = count();
+        if (!n) return 0;
+        uint64_t rank = (uint64_t) (p / 100.0 * n + 0.5), seen = 0;
+        if (rank < 1) rank = 1;
+        for (int i=0; i<HISTOGRAM_BUCKETS; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) return std::min(upper_bound(i), max());
+        }
+        return max();
+    }
+
+private:
+    static void bump(std::atomic<uint64_t> & counter, uint64_t by) {
+        counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    static int bucket(uint64_t value) {
+        if (value < HISTOGRAM_LINEAR) return (int) value;
+        int exp = 63 - __builtin_clzll(value);
+        int sub = (int) (value >> (exp - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+        return HISTOGRAM_LINEAR + ((exp - 4) << HISTOGRAM_SUB_BITS) + sub;
+    }
+
+    static uint64_t upper_bound(int index) {
+        if (index < HISTOGRAM_LINEAR) return index;
+        int exp = ((index - HISTOGRAM_LINEAR) >> HISTOGRAM_SUB_BITS) + 4;
+        uint64_t sub = (index - HISTOGRAM_LINEAR) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+        return (1ULL << exp) + ((sub + 1) << (exp - HISTOGRAM_SUB_BITS)) - 1;
+    }
+
+    std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> total, sum, max_value;
+};
+
+
+#endif
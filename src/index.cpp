@@ -0,0 +1,332 @@
+
+#include "index.h"
+
+
+PathIndex::PathIndex() : current(NULL), fd(-1), master(INDEX_SHARDS), dirty(INDEX_SHARDS, false), entries(0),
+    published(0), dropped(0), rebuilds(0) {}
+
+/* Helper method returns shard of key */
+static inline size_t shard_of(const std::string & key) {
+    return std::hash<std::string>()(key) & (INDEX_SHARDS - 1);
+}
+
+/* Starts the index thread, called after changing into the root directory. Without inotify every path is stat()ed */
+void PathIndex::start() {
+    if ((fd = inotify_init1(IN_CLOEXEC)) == -1) {
+        perror("path index disabled");
+        return;
+    }
+    std::thread(&PathIndex::run, this).detach();
+}
+
+/* Returns hazard slot of the calling thread, registered on first use. Slots outlive the thread */
+PathIndex::reader * PathIndex::local() {
+    static thread_local reader * mine = NULL;
+    if (!mine) {
+        mine = new reader();
+        mine->hazard.store(NULL);
+        std::lock_guard<std::mutex> lg(m);
+        readers.push_back(mine);
+    }
+    return mine;
+}
+
+/*
+ * Helper method makes current snapshot safe to read until the slot is cleared.
+ * Snapshot announced in the slot is used only if it is still current after
+ * that, so the index thread either sees the slot or has not retired it yet.
+ */
+const path_snapshot * PathIndex::pin(reader * r) {
+    const path_snapshot * snap;
+    do {
+        snap = current.load();
+        r->hazard.store(snap);
+    } while (snap != current.load());
+    return snap;
+}
+
+/* Helper method finds entry of key in a pinned snapshot, or NULL */
+const path_info * PathIndex::find(const path_snapshot * snap, const std::string & key) {
+    if (!snap) return NULL;
+    const path_map & shard = *snap->shards[shard_of(key)];
+    path_map::const_iterator it = shard.find(key);
+    return it == shard.end() ? NULL : &it->second;
+}
+
+/* Finds what the request path resolves to. Returns false if the index does not know it */
+bool PathIndex::lookup(const std::string & key, path_info & out) {
+    reader * r = local();
+    const path_info * entry = find(pin(r), key);
+    if (entry) out = *entry;
+    r->hazard.store(NULL, std::memory_order_release);
+    return entry;
+}
+
+/* Gets stat of an indexed path without a system call. Returns false if the index does not know it */
+bool PathIndex::find_stat(const std::string & key, struct stat & info) {
+    reader * r = local();
+    const path_info * entry = find(pin(r), key);
+    if (entry) info = entry->info;
+    r->hazard.store(NULL, std::memory_order_release);
+    return entry;
+}
+
+/* Returns size of the file the path resolves to or -1, for the scheduler */
+off_t PathIndex::size_hint(const std::string & key) {
+    struct stat info;
+    if (!find_stat(key, info) || !S_ISREG(info.st_mode)) return -1;
+    return info.st_size;
+}
+
+/*
+ * Index thread. Walks the root, then waits for inotify events and applies them
+ * to the master map. Events that arrive within INDEX_BATCH_MS of each other
+ * are applied together and published as one snapshot.
+ */
+void PathIndex::run() {
+    walk(".");
+    publish();
+    std::vector<char> buf(INDEX_EVENT_BUFFER);
+    while (true) {
+        std::vector<std::string> changed_dirs;
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        int timeout = -1;
+        while (true) {
+            int ready = poll(&pfd, 1, timeout);
+            if (ready == -1 && errno == EINTR) continue;
+            if (ready <= 0) break;
+            ssize_t len = read(fd, buf.data(), buf.size());
+            if (len == -1 && errno == EINTR) continue;
+            if (len <= 0) break;
+            for (char * p = buf.data(); p < buf.data() + len; ) {
+                const struct inotify_event * ev = (const struct inotify_event *) p;
+                handle(ev, changed_dirs);
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+            timeout = INDEX_BATCH_MS;
+        }
+        /* Directory mtime changes with its entries and its index file may have come or gone */
+        std::sort(changed_dirs.begin(), changed_dirs.end());
+        changed_dirs.erase(std::unique(changed_dirs.begin(), changed_dirs.end()), changed_dirs.end());
+        for (size_t i=0; i<changed_dirs.size(); i++)
+            if (dirs.count(changed_dirs[i])) refresh_dir(changed_dirs[i]);
+        publish();
+    }
+}
+
+/* Helper method applies one inotify event to the master map */
+void PathIndex::handle(const struct inotify_event * ev, std::vector<std::string> & changed_dirs) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        rebuild();
+        return;
+    }
+    std::unordered_map<int, std::string>::iterator w = watches.find(ev->wd);
+    if (w == watches.end()) return;
+    if (ev->mask & IN_IGNORED) {
+        dirs.erase(w->second);
+        watches.erase(w);
+        return;
+    }
+    std::string dir = w->second;
+    if (ev->len) {
+        std::string path = dir + "/" + ev->name;
+        /*
+         * Writes and attribute changes leave the directory as it was, only the
+         * stat of an indexed file is updated; a log file under the root
+         * costs one entry per batch. Directory entries resolve to its index file.
+         */
+        if (!(ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+            if (indexed(path)) refresh(path);
+            if (strcmp(ev->name, SERVER_INDEX_FILE)) return;
+        }
+        else refresh(path);
+    }
+    changed_dirs.push_back(dir);
+}
+
+/*
+ * Helper method adds directory tree to the master map and watches every
+ * directory in it. The watch is added before the directory is read, so an
+ * entry created meanwhile is seen by one or the other.
+ */
+void PathIndex::walk(const std::string & root) {
+    std::vector<std::string> pending(1, root);
+    while (!pending.empty()) {
+        std::string dir = pending.back();
+        pending.pop_back();
+        int wd = inotify_add_watch(fd, dir.c_str(), INDEX_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+        /* Directory without a watch, e.g. over the inotify limit, is left to stat() */
+        if (wd == -1) {
+            dropped++;
+            continue;
+        }
+        watches[wd] = dir;
+        dirs[dir] = wd;
+        DIR * d = opendir(dir.c_str());
+        if (!d) continue;
+        while (struct dirent * item = readdir(d)) {
+            if (!strcmp(item->d_name, ".") || !strcmp(item->d_name, "..")) continue;
+            std::string path = dir + "/" + item->d_name;
+            struct stat info;
+            if (lstat(path.c_str(), &info)) continue;
+            if (S_ISDIR(info.st_mode)) pending.push_back(path);
+            else if (S_ISREG(info.st_mode)) put(path, path, info);
+        }
+        closedir(d);
+        refresh_dir(dir);
+    }
+}
+
+/* Helper method brings entry of a changed path up to date */
+void PathIndex::refresh(const std::string & path) {
+    struct stat info;
+    if (lstat(path.c_str(), &info)) forget(path);
+    else if (S_ISDIR(info.st_mode)) {
+        if (!dirs.count(path)) walk(path);
+    }
+    else if (S_ISREG(info.st_mode)) put(path, path, info);
+    else forget(path);
+}
+
+/*
+ * Helper method sets entries of a directory, with and without the trailing
+ * slash. They resolve to its index file if it has one, or to the directory
+ * itself for a listing.
+ */
+void PathIndex::refresh_dir(const std::string & dir) {
+    struct stat info;
+    std::string index = dir + "/" SERVER_INDEX_FILE;
+    erase(dir);
+    erase(dir + "/");
+    if (!lstat(index.c_str(), &info)) {
+        /* Index file that is a link is left to stat() together with the directory */
+        if (!S_ISREG(info.st_mode)) return;
+    }
+    else if (stat(dir.c_str(), &info)) return;
+    else index = dir;
+    put(dir, index, info);
+    put(dir + "/", index, info);
+}
+
+/* Helper method stores entry of the master map, unless the map is full */
+void PathIndex::put(const std::string & key, const std::string & path, const struct stat & info) {
+    size_t s = shard_of(key);
+    path_map::iterator it = master[s].find(key);
+    if (it == master[s].end()) {
+        if (entries >= INDEX_MAX_ENTRIES) {
+            dropped++;
+            return;
+        }
+        it = master[s].insert(path_map::value_type(key, path_info())).first;
+        entries++;
+    }
+    dirty[s] = true;
+    path_info & entry = it->second;
+    entry.path = path;
+    entry.info = info;
+    entry.content_type = S_ISREG(info.st_mode) ? get_file_extension(path.c_str()) : HTML;
+}
+
+/* Helper method checks whether the master map has key */
+bool PathIndex::indexed(const std::string & key) {
+    return master[shard_of(key)].count(key);
+}
+
+/* Helper method removes key from the master map */
+void PathIndex::erase(const std::string & key) {
+    size_t s = shard_of(key);
+    if (!master[s].erase(key)) return;
+    entries--;
+    dirty[s] = true;
+}
+
+/* Helper method removes path, and everything under it if it was a watched directory */
+void PathIndex::forget(const std::string & path) {
+    erase(path);
+    erase(path + "/");
+    if (!dirs.count(path)) return;
+    std::string prefix = path + "/";
+    for (size_t s=0; s<INDEX_SHARDS; s++) {
+        for (path_map::iterator it = master[s].begin(); it != master[s].end(); ) {
+            if (it->first.compare(0, prefix.size(), prefix)) {
+                ++it;
+                continue;
+            }
+            it = master[s].erase(it);
+            entries--;
+            dirty[s] = true;
+        }
+    }
+    for (std::unordered_map<std::string, int>::iterator it = dirs.begin(); it != dirs.end(); ) {
+        if (it->first == path || !it->first.compare(0, prefix.size(), prefix)) {
+            inotify_rm_watch(fd, it->second);
+            watches.erase(it->second);
+            it = dirs.erase(it);
+        }
+        else ++it;
+    }
+}
+
+/* Helper method starts over after the kernel dropped events */
+void PathIndex::rebuild() {
+    for (std::unordered_map<int, std::string>::iterator it = watches.begin(); it != watches.end(); ++it)
+        inotify_rm_watch(fd, it->first);
+    watches.clear();
+    dirs.clear();
+    for (size_t s=0; s<INDEX_SHARDS; s++) {
+        master[s].clear();
+        dirty[s] = true;
+    }
+    entries = 0;
+    rebuilds++;
+    walk(".");
+}
+
+/*
+ * Helper method publishes master map as a snapshot that copies the shards
+ * changed since the last one and shares the rest, and frees the old snapshot
+ * once no reader holds it. Shards are freed with the last snapshot using them.
+ */
+void PathIndex::publish() {
+    const path_snapshot * old = current.load();
+    if (old && std::find(dirty.begin(), dirty.end(), true) == dirty.end()) return;
+    path_snapshot * next = new path_snapshot();
+    next->shards.resize(INDEX_SHARDS);
+    for (size_t s=0; s<INDEX_SHARDS; s++) {
+        if (old && !dirty[s]) next->shards[s] = old->shards[s];
+        else next->shards[s] = std::make_shared<const path_map>(master[s]);
+        dirty[s] = false;
+    }
+    next->entries = entries;
+    current.store(next);
+    published++;
+    if (!old) return;
+    while (true) {
+        bool used = false;
+        {
+            std::lock_guard<std::mutex> lg(m);
+            /****************** Critical section ****************/
+            for (size_t i=0; i<readers.size() && !used; i++)
+                used = readers[i]->hazard.load() == old;
+            /****************************************************/
+        }
+        if (!used) break;
+        /* Readers hold a snapshot for one hash lookup */
+        std::this_thread::yield();
+    }
+    delete old;
+}
+
+/* Returns index counters for the stats report */
+std::string PathIndex::stats() {
+    size_t count = 0;
+    reader * r = local();
+    if (const path_snapshot * snap = pin(r)) count = snap->entries;
+    r->hazard.store(NULL, std::memory_order_release);
+    std::stringstream out;
+    out << "index: entries=" << count << " snapshots=" << published << " dropped=" << dropped
+        << " rebuilds=" << rebuilds << '\n';
+    return out.str();
+}
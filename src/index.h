@@ -0,0 +1,90 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "myhttpd.h"
+#include <sys/inotify.h>
+#include <unordered_map>
+
+/* Index settings */
+#define INDEX_MAX_ENTRIES                   (1 << 20)   // paths over the limit are left to stat()
+#define INDEX_BATCH_MS                      10          // events collected before a snapshot is published
+#define INDEX_EVENT_BUFFER                  65536
+#define INDEX_SHARDS                        4096        // power of two, a batch copies only the shards it changed
+#define INDEX_EVENTS                        (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE \
+                                             | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* What a request path resolves to: the file to send, or the directory to list */
+struct path_info {
+    std::string path;
+    struct stat info;
+    extension content_type;
+};
+
+typedef std::unordered_map<std::string, path_info> path_map;
+
+/* Published index, shards a batch did not change are shared with the snapshot before */
+struct path_snapshot {
+    std::vector<std::shared_ptr<const path_map> > shards;
+    size_t entries;
+};
+
+/*
+ * Index of every file and directory under the server root keyed by normalized
+ * request path, with the index file of directories already resolved. One
+ * thread walks the root at startup and then follows inotify events. It owns
+ * the master map, split into shards by key hash, and after each batch of
+ * events publishes a snapshot that copies only the shards the batch changed.
+ * A file whose contents or attributes change only gets its stat updated.
+ * Readers never lock: a reader announces the snapshot it uses in its
+ * own hazard slot and checks that it is still current, and the index thread
+ * frees an old snapshot only when no slot holds it. Symbolic links are not
+ * indexed, since inotify does not see changes of their targets; such paths,
+ * and all paths while the index is not ready, are resolved with stat().
+ */
+class PathIndex {
+public:
+    PathIndex();
+    void start();
+    bool lookup(const std::string &, path_info &);
+    bool find_stat(const std::string &, struct stat &);
+    off_t size_hint(const std::string &);
+    std::string stats();
+private:
+    struct reader {
+        std::atomic<const path_snapshot *> hazard;
+        char pad[CACHE_LINE_SIZE - sizeof(std::atomic<const path_snapshot *>)];
+    };
+
+    reader * local();
+    const path_snapshot * pin(reader *);
+    const path_info * find(const path_snapshot *, const std::string &);
+    void run();
+    void publish();
+    void handle(const struct inotify_event *, std::vector<std::string> &);
+    void walk(const std::string &);
+    void refresh(const std::string &);
+    void refresh_dir(const std::string &);
+    void put(const std::string &, const std::string &, const struct stat &);
+    bool indexed(const std::string &);
+    void erase(const std::string &);
+    void forget(const std::string &);
+    void rebuild();
+
+    std::atomic<const path_snapshot *> current;
+    std::mutex m;                                       // guards the list of readers
+    std::vector<reader *> readers;
+    /* Owned by the index thread */
+    int fd;
+    std::vector<path_map> master;                       // by shard
+    std::vector<bool> dirty;                            // shards changed since the last snapshot
+    size_t entries;
+    std::unordered_map<int, std::string> watches;
+    std::unordered_map<std::string, int> dirs;
+    std::atomic<unsigned long> published, dropped, rebuilds;
+};
+
+/* Index of the server root, defined in myhttpd.cpp */
+extern PathIndex path_index;
+
+
+#endif
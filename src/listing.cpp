@@ -0,0 +1,57 @@
+
+#include "listing.h"
+
+#define LISTING_HEAD                        "<html>\n<head><title>Directory Listing</title></head>\n<body>\n<h2>Listing of "
+#define LISTING_TAIL                        "</body>\n</html>\n"
+
+/* Helper method appends string to the page being rendered */
+static inline char * append(char * p, const char * str, size_t len) {
+    memcpy(p, str, len);
+    return p + len;
+}
+
+/*
+ * Renders HTML listing of the directory at path, titled with page, into a new
+ * buffer and stores its length in size. Hidden entries are skipped. Only the
+ * first cap names in alphabetical order are kept while reading, in a max-heap
+ * that drops the largest name when it grows over the cap, so memory depends on
+ * the cap and not on the directory. No cap or a larger one is held to
+ * LISTING_MAX_NAMES. Returns NULL if the directory can not be read.
+ */
+char * render_listing(const char * path, const char * page, size_t cap, size_t & size) {
+    DIR * dir = opendir(path);
+    if (!dir) return NULL;
+    if (!cap || cap > LISTING_MAX_NAMES) cap = LISTING_MAX_NAMES;
+    std::vector<std::string> names;
+    size_t hidden = 0;
+    while (struct dirent * item = readdir(dir)) {
+        if (item->d_name[0] == '.') continue;
+        if (names.size() == cap) {
+            hidden++;
+            if (strcmp(item->d_name, names.front().c_str()) >= 0) continue;
+            std::pop_heap(names.begin(), names.end());
+            names.back() = item->d_name;
+        }
+        else names.emplace_back(item->d_name);
+        std::push_heap(names.begin(), names.end());
+    }
+    closedir(dir);
+    std::sort_heap(names.begin(), names.end());
+    char more[64] = "";
+    if (hidden) snprintf(more, sizeof(more), "<p>%zu more entries not shown</p>\n", hidden);
+    /* Page is measured first, so it is written once into a buffer of its exact size */
+    size_t page_len = strlen(page), more_len = strlen(more);
+    size = strlen(LISTING_HEAD) + page_len + strlen(":</h2><br>\n") + more_len + strlen(LISTING_TAIL);
+    for (size_t i=0; i<names.size(); i++) size += names[i].size() + 5;
+    char * out = new char[size], * p = out;
+    p = append(p, LISTING_HEAD, strlen(LISTING_HEAD));
+    p = append(p, page, page_len);
+    p = append(p, ":</h2><br>\n", 11);
+    for (size_t i=0; i<names.size(); i++) {
+        p = append(p, names[i].data(), names[i].size());
+        p = append(p, "<br>\n", 5);
+    }
+    p = append(p, more, more_len);
+    append(p, LISTING_TAIL, strlen(LISTING_TAIL));
+    return out;
+}
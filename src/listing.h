@@ -0,0 +1,12 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include "myhttpd.h"
+
+/* Listing settings */
+#define LISTING_MAX_NAMES                   65536       // hard cap, -L 0 and larger values are held to it
+
+char * render_listing(const char *, const char *, size_t, size_t &);
+
+
+#endif
@@ -0,0 +1,177 @@
+
+#include "log.h"
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <thread>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+
+
+/* Marks ring of an exiting thread, the writer frees it once it is drained */
+struct ring_holder {
+    log_ring * ring = NULL;
+    ~ring_holder() {
+        if (ring) ring->orphaned.store(true, std::memory_order_release);
+    }
+};
+
+Log::Log() : fd(-1), flush_ms(LOG_DEFAULT_FLUSH_MS), blocking(false), kicked(false), rounds(0),
+    waiting(0), retired_lines(0), dropped(0) {}
+
+/* Opens logfile for appending, empty path means standard output */
+bool Log::openlogfile(std::string path) {
+    if (path.empty()) fd = STDOUT_FILENO;
+    else fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return fd != -1;
+}
+
+/* Starts the writer thread, must be called after the process is daemonized */
+void Log::start() {
+    if (fd == -1) return;
+    /* localtime_r() does not read timezone by itself */
+    tzset();
+    std::thread(&Log::writer, this).detach();
+}
+
+/* Waits until lines queued before the call are written, used before the process exits */
+void Log::flush() {
+    if (fd == -1) return;
+    /* Pass under way may have taken its list of rings already, the one after it sees every line */
+    unsigned long target = rounds.load() + 2;
+    while (rounds.load() < target) {
+        kick();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/* Returns ring of the calling thread, there is one logger per process */
+log_ring * Log::thread_ring() {
+    static thread_local ring_holder holder;
+    if (!holder.ring) {
+        holder.ring = new log_ring();
+        std::lock_guard<std::mutex> lg(m);
+        rings.push_back(holder.ring);
+    }
+    return holder.ring;
+}
+
+/* Queues a complete log line, it is written by the writer thread later */
+void Log::execute(const char * line, size_t len) {
+    if (fd == -1) return;
+    log_ring * ring = thread_ring();
+    while (!append(ring, line, len)) {
+        kick();
+        if (!blocking) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        waiting++;
+        std::unique_lock<std::mutex> lock(m);
+        /* Timeout covers a notification sent before this thread started waiting */
+        cv_space.wait_for(lock, std::chrono::milliseconds(1));
+        lock.unlock();
+        waiting--;
+    }
+    ring->lines.store(ring->lines.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/* Helper method copies line into ring, returns false if there is no room */
+bool Log::append(log_ring * ring, const char * line, size_t len) {
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    size_t used = head - ring->tail.load(std::memory_order_acquire);
+    if (LOG_RING_SIZE - used < len) return false;
+    size_t at = head % LOG_RING_SIZE, first = std::min(len, LOG_RING_SIZE - at);
+    memcpy(ring->data + at, line, first);
+    memcpy(ring->data, line + first, len - first);
+    ring->head.store(head + len, std::memory_order_release);
+    /* Do not wait for the flush interval when ring is getting full */
+    if (used + len > LOG_RING_SIZE / 2) kick();
+    return true;
+}
+
+/*
+ * Helper method wakes the writer. It is notified without the mutex, so a wake-up
+ * may be missed; the writer then runs at the end of its flush interval anyway.
+ */
+void Log::kick() {
+    if (!kicked.exchange(true)) cv_writer.notify_one();
+}
+
+void Log::writer() {
+    char * batch = new char[LOG_BATCH_SIZE];
+    std::vector<log_ring *> current;
+    while (true) {
+        std::unique_lock<std::mutex> lock(m);
+        cv_writer.wait_for(lock, std::chrono::milliseconds(flush_ms), [this](){ return kicked.load(); });
+        kicked = false;
+        current = rings;
+        lock.unlock();
+        size_t len = 0;
+        for (size_t i=0; i<current.size(); i++) {
+            log_ring * ring = current[i];
+            /* Orphaned flag is read first, so an empty ring has no more lines coming */
+            bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+            drain(ring, batch, len);
+            if (orphaned) {
+                lock.lock();
+                rings.erase(std::find(rings.begin(), rings.end(), ring));
+                lock.unlock();
+                retired_lines += ring->lines.load(std::memory_order_relaxed);
+                delete ring;
+            }
+        }
+        if (len) write_out(batch, len);
+        rounds++;
+        if (waiting.load()) {
+            lock.lock();
+            cv_space.notify_all();
+            lock.unlock();
+        }
+    }
+}
+
+/* Helper method moves all lines of a ring into the batch, writing the batch out whenever it fills up */
+void Log::drain(log_ring * ring, char * batch, size_t & len) {
+    size_t head = ring->head.load(std::memory_order_acquire);
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    while (tail < head) {
+        if (len == LOG_BATCH_SIZE) {
+            write_out(batch, len);
+            len = 0;
+        }
+        size_t at = tail % LOG_RING_SIZE;
+        size_t chunk = std::min(std::min(head - tail, LOG_RING_SIZE - at), LOG_BATCH_SIZE - len);
+        memcpy(batch + len, ring->data + at, chunk);
+        len += chunk;
+        tail += chunk;
+    }
+    ring->tail.store(tail, std::memory_order_release);
+}
+
+/* Helper method writes whole batch, looping on partial writes */
+void Log::write_out(const char * buf, size_t len) {
+    while (len) {
+        ssize_t done = write(fd, buf, len);
+        if (done == -1 && errno == EINTR) continue;
+        if (done <= 0) return;
+        buf += done;
+        len -= done;
+    }
+}
+
+/* Returns counters as a single line */
+std::string Log::stats() {
+    unsigned long lines = retired_lines;
+    size_t threads;
+    {
+        std::lock_guard<std::mutex> lg(m);
+        for (size_t i=0; i<rings.size(); i++) lines += rings[i]->lines.load(std::memory_order_relaxed);
+        threads = rings.size();
+    }
+    std::stringstream out;
+    out << "log: lines=" << lines << " dropped=" << dropped << " threads=" << threads << '\n';
+    return out.str();
+}
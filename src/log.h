@@ -0,0 +1,71 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "deque.h"
+
+/* Logger settings */
+#define LOG_RING_SIZE                       (64 << 10)
+#define LOG_LINE_LENGTH                     1280
+#define LOG_BATCH_SIZE                      (256 << 10)
+#define LOG_DEFAULT_FLUSH_MS                100
+#define LOG_DATE_LENGTH                     50
+
+/*
+ * Single producer, single consumer byte ring holding log lines of one thread.
+ * Positions only grow, the index into data is position modulo LOG_RING_SIZE.
+ */
+struct log_ring {
+    std::atomic<size_t> head;                           // written by the owning thread
+    char pad_head[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;                           // written by the log writer
+    char pad_tail[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<bool> orphaned;                         // owning thread has exited
+    std::atomic<unsigned long> lines;                   // written by the owning thread
+    char data[LOG_RING_SIZE];
+    log_ring() : head(0), tail(0), orphaned(false), lines(0) {}
+};
+
+/*
+ * Asynchronous access logger. Every thread appends lines to its own ring
+ * without locks, a writer thread collects them every flush interval (or
+ * sooner when a ring fills up) and writes them with one large write().
+ * When a ring is full the line is dropped, or with blocking policy the
+ * thread waits until the writer has made room.
+ */
+class Log {
+public:
+    Log();
+    void execute(const char *, size_t);
+    bool openlogfile(std::string);
+    void start();
+    void flush();
+    bool is_enabled() const { return fd != -1; }
+    void set_flush_interval(int ms) { flush_ms = ms; }
+    void set_blocking(bool b) { blocking = b; }
+    std::string stats();
+private:
+    log_ring * thread_ring();
+    bool append(log_ring *, const char *, size_t);
+    void kick();
+    void writer();
+    void drain(log_ring *, char *, size_t &);
+    void write_out(const char *, size_t);
+
+    int fd, flush_ms;
+    bool blocking;
+    std::mutex m;                                       // guards rings list and condition variables
+    std::condition_variable cv_writer, cv_space;
+    std::vector<log_ring *> rings;
+    std::atomic<bool> kicked;
+    std::atomic<unsigned long> rounds;                  // passes of the writer over the rings
+    std::atomic<int> waiting;
+    std::atomic<unsigned long> retired_lines, dropped;
+};
+
+
+#endif
@@ -0,0 +1,95 @@
+
+#include "myhttpd.h"
+#include "reactor.h"
+#include "pool.h"
+#include "policy.h"
+#include "stats.h"
+#include "index.h"
+#include "startup.h"
+#include "topology.h"
+
+
+/* Queuing thread */
+int main(int argc, char * argv[]) {
+    /* Parsing command line arguments */
+    parse_args(argc, argv);
+    if (!(scheduling_policy = make_policy(serv_params.policy, serv_params.aging_rate)))
+        print_usage(argv[0]);
+    /* Writes to a closed connection must fail with EPIPE instead of killing the server */
+    signal(SIGPIPE, SIG_IGN);
+    /* SIGUSR1 is blocked in every thread and read by the reactor through signalfd */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    /* Run as daemon if not in debugging mode */
+    if (!serv_params.debugging) daemon_mode();
+    /* Changing root directory for the server */
+    chdir(serv_params.root_dir.c_str());
+    if (serv_params.path_index) path_index.start();
+    /* Log to standard output in debugging mode, otherwise to logfile if given */
+    if (serv_params.debugging) logging.openlogfile("");
+    else if (!serv_params.logfile.empty() && !logging.openlogfile(serv_params.logfile))
+        pr_error("failed open logfile");
+    logging.start();
+    server_stats.calibrate();
+    init_header_templates();
+    server_clock.start();
+    /*
+     * Running server found on the handover socket keeps serving while this one
+     * warms its cache, then hands over its listening sockets, one per acceptor
+     */
+    std::vector<int> listeners;
+    bool warm = !serv_params.warmup.empty();
+    int handover_fd = -1;
+    if (!serv_params.handover.empty()) {
+        int old_server = connect_handover(serv_params.handover);
+        if (old_server != -1) {
+            if (warm) warm_cache(serv_params.warmup);
+            warm = false;
+            listeners = take_listeners(old_server);
+            if (!listeners.empty()) serv_params.acceptors = listeners.size();
+        }
+        serv_params.acceptors = std::min(serv_params.acceptors, STARTUP_MAX_LISTENERS);
+        handover_fd = listen_handover(serv_params.handover);
+    }
+    /* Shards get CPUs by topology, read before any thread is pinned */
+    std::vector<cpu_place> places;
+    std::vector<int> cpus(serv_params.acceptors, -1);
+    std::vector<std::vector<int> > worker_cpus(serv_params.acceptors);
+    if (serv_params.pin_cpus) {
+        places = read_topology();
+        cpus = shard_cpus(places, serv_params.acceptors);
+        for (int i=0; i<serv_params.acceptors; i++) worker_cpus[i] = node_cpus(places, cpus[i]);
+    }
+    /*
+     * Every acceptor is a shard with its own listening socket, reactor, request
+     * queue and workers; worker threads are split evenly between shards
+     */
+    std::vector<WorkerPool *> pools;
+    std::vector<Reactor *> reactors;
+    for (int i=0; i<serv_params.acceptors; i++) {
+        int threads = serv_params.threads / serv_params.acceptors + (i < serv_params.threads % serv_params.acceptors);
+        int least = serv_params.threads_min / serv_params.acceptors + (i < serv_params.threads_min % serv_params.acceptors);
+        pools.push_back(new WorkerPool(std::max(threads, 1), worker_cpus[i], serv_params.threads_min ? std::max(least, 1) : 0));
+        server_stats.add_pool(pools[i]);
+        if ((int) listeners.size() <= i) listeners.push_back(create_socket_open_port());
+        reactors.push_back(new Reactor(listeners[i], pools[i]));
+    }
+    if (serv_params.pin_cpus && serv_params.acceptors > 1) steer_connections(listeners[0], places, cpus);
+    if (handover_fd != -1) std::thread(handover_thread, handover_fd, listeners, reactors).detach();
+    /* Creating scheduling thread */
+    std::thread scheduler(scheduling_thread, pools, warm);
+    /* Accepting connections and queuing complete requests, first shard runs on this thread */
+    std::vector<std::thread> acceptors;
+    for (int i=1; i<serv_params.acceptors; i++)
+        acceptors.push_back(std::thread(run_acceptor, reactors[i], cpus[i]));
+    run_acceptor(reactors[0], cpus[0]);
+    scheduler.join();
+    for (size_t i=0; i<acceptors.size(); i++) acceptors[i].join();
+    /* Listening sockets were handed over and every connection is closed */
+    freeaddrinfo(socket_info);
+    logging.flush();
+    /* Workers and the log writer still wait for work, static objects must not be destroyed under them */
+    _exit(EXIT_SUCCESS);
+}
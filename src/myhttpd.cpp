@@ -1,19 +1,41 @@
 
 #include "myhttpd.h"
+#include "reactor.h"
+#include "pool.h"
+#include "cache.h"
+#include "gzip.h"
+#include "range.h"
+#include "listing.h"
+#include "index.h"
+#include "policy.h"
+#include "stats.h"
+#include "startup.h"
 
 
-int socket_fd, con_fd, y = 1;
-struct addrinfo socket_init_info, *socket_info;
-struct sockaddr_in con_info;
-socklen_t con_socklen = sizeof(con_info);
+int y = 1;
+struct addrinfo socket_init_info, *socket_info = NULL;
+struct parameters serv_params;
 Log logging;
-std::priority_queue<http_request *, std::vector<http_request *>,
-                    std::function<bool(http_request *, http_request *)>> * request_queue;
-std::mutex mutex_rq;
-std::condition_variable cv_rq;
-std::vector<std::mutex *> mutex_wt;
-std::vector<std::condition_variable *> cv_wt;
-std::vector<http_request *> jobs;
+FileCache file_cache("cache", SERVER_DEFAULT_CACHE_SIZE);
+FileCache gzip_cache("gzip cache", SERVER_DEFAULT_GZIP_CACHE_SIZE);
+PathIndex path_index;
+ServerClock server_clock;
+SchedulingPolicy * scheduling_policy;
+ServerStats server_stats;
+
+/* Statuses the server answers with, in the order of header_templates rows */
+static const int http_status_codes[] = {
+    HTTP_STATUS_CODE_OK, HTTP_STATUS_CODE_BAD_REQUEST, HTTP_STATUS_CODE_NOTFOUND, HTTP_STATUS_CODE_PARTIAL,
+    HTTP_STATUS_CODE_NOT_MODIFIED, HTTP_STATUS_CODE_RANGE, HTTP_STATUS_CODE_UNAVAILABLE
+};
+#define HTTP_STATUS_COUNT (sizeof(http_status_codes) / sizeof(http_status_codes[0]))
+
+/* Status line, Server and Content-Type headers rendered once for every status and MIME type */
+struct header_template {
+    char text[HEADER_TEMPLATE_LENGTH];
+    size_t len;
+};
+static header_template header_templates[HTTP_STATUS_COUNT][UNKNOWN + 1];
 
 
 /* Turns caller process into daemon */
@@ -32,11 +54,32 @@ void print_usage(const char * exec) {
                 << "Options:\n" << "\t-d\t\tEnter debugging mode;\n"
                 << "\t-h\t\tPrint a usage summary;\n"
                 << "\t-l <file>\tLog all requests to the given file;\n"
+                << "\t-f <ms>\t\tSet log flush interval in milliseconds, at least 1. Default: 100;\n"
+                << "\t-o <policy>\tSet log overflow policy: drop or block. Default: drop;\n"
                 << "\t-p <port>\tListen on the given port;\n"
                 << "\t-r <dir>\tSet root directory for the server;\n"
-                << "\t-t <time>\tSet queuing time in seconds;\n"
-                << "\t-n <threads>\tSet number of threads. Default: 4;\n"
-                << "\t-s <policy>\tSet scheduling policy: FCFS or SJF. Default: FCFS;\n\n";
+                << "\t-t <time>\tSet queuing time in seconds before workers start. Default: 0;\n"
+                << "\t-n <threads>\tSet number of threads, or min:max to size pools by load. Default: 4;\n"
+                << "\t-c <size>\tSet file cache size in bytes, K/M/G suffix allowed, 0 disables. Default: 64M;\n"
+                << "\t-z <size>\tSet cache size for gzip variants in bytes, K/M/G suffix allowed, 0 disables gzip. Default: 16M;\n"
+                << "\t-s <policy>\tSet scheduling policy: FCFS, SJF, SRPT or EDF. Default: FCFS;\n"
+                << "\t-g <rate>\tSet SJF aging in bytes per second of waiting, K/M/G suffix allowed, 0 disables. Default: 1M;\n"
+                << "\t-a <acceptors>\tSet number of SO_REUSEPORT listeners, each with its own queue and workers. Default: 1;\n"
+                << "\t-P\t\tPin every acceptor to a core chosen by CPU topology, its workers to its NUMA node, and steer connections to it;\n"
+                << "\t-u\t\tAccept and read connections with io_uring, epoll if the kernel has none;\n"
+                << "\t-I\t\tDo not index root directory, stat() every requested path;\n"
+                << "\t-L <entries>\tSet maximum number of names in a directory listing, 0 for the most allowed (65536). Default: 10000;\n"
+                << "\t-Q <requests>\tSet maximum number of requests waiting for a worker in a shard, 0 is unbounded. Default: 0;\n"
+                << "\t-w <ms>\t\tSet maximum time a request may wait for a worker, 0 is unbounded. Default: 0;\n"
+                << "\t-D <ms>\t\tShed load with CoDel to keep queuing delay near the target, 0 disables. Default: 0;\n"
+                << "\t-F <bits>\tShare workers fairly between clients told apart by this many address bits, 32 per address, 24 per subnet, 0 disables. Default: 0;\n"
+                << "\t-C <requests>\tSet maximum number of requests of one client served at once with -F, 0 is unbounded. Default: 0;\n"
+                << "\t-k <time>\tSet keep-alive timeout in seconds, 0 disables keep-alive. Default: 5;\n"
+                << "\t-m <requests>\tSet maximum number of requests per connection. Default: 100;\n"
+                << "\t-R <time>\tSet time in seconds to receive a request head, 0 disables. Default: 10;\n"
+                << "\t-S <time>\tSet time in seconds a response may wait for the client to read, 0 disables. Default: 60;\n"
+                << "\t-W <file>\tRead files most requested in a log, or listed one path per line, into the cache at startup;\n"
+                << "\t-U <path>\tTake listening sockets from the server running with the same Unix socket path and hand them on at the next restart;\n\n";
     exit(0);
 }
 
@@ -51,6 +94,7 @@ void parse_args(int ac, char * av[]) {
                     case 'd':
                     serv_params.debugging = true;
                     serv_params.threads = 1;
+                    serv_params.threads_min = 0;
                     break;
                     case 'h':
                     print_usage(exec_name);
@@ -58,6 +102,23 @@ void parse_args(int ac, char * av[]) {
                     if (++i >= ac) print_usage(exec_name);
                     serv_params.logfile = av[i];
                     break;
+                    case 'f':
+                    {
+                        if (++i >= ac) print_usage(exec_name);
+                        /* Writer waits this long between flushes, 0 would make it spin */
+                        int flush_ms = std::stoi(av[i]);
+                        if (flush_ms < 1) print_usage(exec_name);
+                        logging.set_flush_interval(flush_ms);
+                        break;
+                    }
+                    case 'o':
+                    {
+                        if (++i >= ac) print_usage(exec_name);
+                        std::string policy = av[i];
+                        if (policy == "block") logging.set_blocking(true);
+                        else if (policy != "drop") print_usage(exec_name);
+                        break;
+                    }
                     case 'p':
                     if (++i >= ac) print_usage(exec_name);
                     serv_params.port = av[i];
@@ -72,21 +133,92 @@ void parse_args(int ac, char * av[]) {
                     break;
                     case 'n':
                     if (++i >= ac) print_usage(exec_name);
-                    serv_params.threads = (serv_params.debugging) ? 1 : std::stoi(av[i]);
+                    if (serv_params.debugging) break;
+                    /* min:max lets the pools size themselves between the two */
+                    if (const char * colon = strchr(av[i], ':')) {
+                        serv_params.threads_min = std::max(std::stoi(av[i]), 1);
+                        serv_params.threads = std::max(std::stoi(colon + 1), serv_params.threads_min);
+                    }
+                    else serv_params.threads = std::stoi(av[i]);
+                    break;
+                    case 'a':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.acceptors = std::max(std::stoi(av[i]), 1);
+                    break;
+                    case 'P':
+                    serv_params.pin_cpus = true;
+                    break;
+                    case 'k':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.keepalive_timeout = std::stoi(av[i]);
+                    break;
+                    case 'm':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.keepalive_max = std::stoi(av[i]);
+                    break;
+                    case 'R':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.header_timeout = std::stoi(av[i]);
+                    break;
+                    case 'S':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.send_timeout = std::stoi(av[i]);
+                    break;
+                    case 'c':
+                    if (++i >= ac) print_usage(exec_name);
+                    file_cache.set_capacity(parse_size(av[i]));
+                    break;
+                    case 'z':
+                    if (++i >= ac) print_usage(exec_name);
+                    gzip_cache.set_capacity(parse_size(av[i]));
                     break;
                     case 's':
-                    {
-                        if (++i >= ac) print_usage(exec_name);
-                        std::string policy = av[i];
-                        if (policy == "SJF") {
-                            delete request_queue;
-                            request_queue = new std::priority_queue<http_request *, std::vector<http_request *>,
-                                                std::function<bool(http_request *, http_request *)>>(compare_size);
-                        }
-                        else if (policy == "FCFS") {}
-                        else print_usage(exec_name);
-                        break;
-                    }
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.policy = av[i];
+                    break;
+                    case 'g':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.aging_rate = parse_size(av[i]);
+                    break;
+                    case 'u':
+                    serv_params.io_uring = true;
+                    break;
+                    case 'Q':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.queue_max = std::stoul(av[i]);
+                    break;
+                    case 'w':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.queue_wait = std::stoi(av[i]);
+                    break;
+                    case 'D':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.codel_target = std::stoi(av[i]);
+                    break;
+                    case 'F':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.fair_prefix = std::stoi(av[i]);
+                    if (serv_params.fair_prefix < 0 || serv_params.fair_prefix > 32) print_usage(exec_name);
+                    break;
+                    case 'C':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.client_cap = std::stoul(av[i]);
+                    break;
+                    case 'I':
+                    serv_params.path_index = false;
+                    break;
+                    case 'L':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.listing_max = std::stoul(av[i]);
+                    break;
+                    case 'W':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.warmup = av[i];
+                    break;
+                    case 'U':
+                    if (++i >= ac) print_usage(exec_name);
+                    serv_params.handover = av[i];
+                    break;
                 }
             }
             else print_usage(exec_name);
@@ -97,36 +229,54 @@ void parse_args(int ac, char * av[]) {
     }
 }
 
+/* Helper method converts size with optional K, M or G suffix to bytes */
+size_t parse_size(const char * arg) {
+    size_t pos;
+    size_t size = std::stoull(arg, &pos);
+    int shift = 0;
+    switch (arg[pos]) {
+        case 'G': case 'g': shift = 30; break;
+        case 'M': case 'm': shift = 20; break;
+        case 'K': case 'k': shift = 10; break;
+        case '\0': break;
+        default: throw std::invalid_argument(arg);
+    }
+    return size << shift;
+}
+
 /* Helper method to print errno to stderr */
 void pr_error(const char * msg) {
     perror(msg);
     exit(1);
 }
 
-/* Helper method to compare timestamps of two requests */
-bool compare_time(http_request * r1, http_request * r2) {
-    return r1->timestamp >= r2->timestamp;
-}
-
-/* Helper method to compare filesizes of two requests */
-bool compare_size(http_request * r1, http_request * r2) {
-    return r1->f_size >= r2->f_size;
-}
-
-void create_socket_open_port() {
-    /* Filling up socket_init_info with initial information */
-    memset(&socket_init_info, 0, sizeof(socket_init_info));                 // Emptying the structure
-    socket_init_info.ai_family = AF_INET;                                   // Use IPv4 address
-    socket_init_info.ai_flags = AI_PASSIVE;                                 // Get the address of localhost
-    socket_init_info.ai_socktype = SOCK_STREAM;                             // Socket type set to TCP
+/*
+ * Creates non-blocking listening socket on the server port and returns it. With
+ * more than one acceptor every call opens another socket bound to the same port
+ * with SO_REUSEPORT, and the kernel spreads incoming connections between them.
+ */
+int create_socket_open_port() {
+    int socket_fd;
+    if (socket_info == NULL) {
+        /* Filling up socket_init_info with initial information */
+        memset(&socket_init_info, 0, sizeof(socket_init_info));                 // Emptying the structure
+        socket_init_info.ai_family = AF_INET;                                   // Use IPv4 address
+        socket_init_info.ai_flags = AI_PASSIVE;                                 // Get the address of localhost
+        socket_init_info.ai_socktype = SOCK_STREAM;                             // Socket type set to TCP
 
-    /* Filling up socket_info structure */
-    getaddrinfo(NULL, serv_params.port.c_str(), &socket_init_info, &socket_info);
-    /* Creating a socket */
-    if ((socket_fd = socket(socket_info->ai_family, socket_info->ai_socktype, socket_info->ai_protocol)) == -1)
+        /* Filling up socket_info structure */
+        if (getaddrinfo(NULL, serv_params.port.c_str(), &socket_init_info, &socket_info))
+            pr_error("cannot resolve listening address");
+    }
+    /* Creating a non-blocking socket, the reactor accepts from it until EAGAIN */
+    if ((socket_fd = socket(socket_info->ai_family, socket_info->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            socket_info->ai_protocol)) == -1)
         pr_error("error while creating socket");
-    /* Set REUSEPORT option so the program can reuse the port after restart */
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &y, socket_info->ai_addrlen) == -1)
+    /* Set REUSEADDR option so the program can reuse the port after restart */
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y)) == -1)
+        pr_error("failed setting socket option");
+    /* Every acceptor gets its own socket on the same port */
+    if (serv_params.acceptors > 1 && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &y, sizeof(y)) == -1)
         pr_error("failed setting socket option");
     /* Binding socket to the port */
     if ((bind(socket_fd, socket_info->ai_addr, socket_info->ai_addrlen)) == -1)
@@ -134,12 +284,33 @@ void create_socket_open_port() {
     /* Openning the port on localhost. SOMAXCONN defines queue length of completely established sockets */
     if ((listen(socket_fd, SOMAXCONN)) == -1)
         pr_error("cannot open the port");
+    return socket_fd;
+}
+
+/* Helper method binds calling thread to one CPU, -1 leaves it unbound */
+void pin_thread(int cpu) {
+    if (cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* Helper method binds calling thread to a set of CPUs, an empty one leaves it unbound */
+void pin_thread(const std::vector<int> & cpus) {
+    if (cpus.empty()) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i=0; i<cpus.size(); i++) CPU_SET(cpus[i], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
 }
 
 /* Helper method prints debugging message and queuing counter to standart output */
 void print_debugging_message() {
+    /* Sockets taken over from a running server were not resolved here */
     std::cout   << "\n* Debugging mode.\n* Waiting for incoming connections at "
-                << get_ip((sockaddr_in *)socket_info->ai_addr) << ":" << serv_params.port << "\n\n";
+                << (socket_info ? get_ip((sockaddr_in *)socket_info->ai_addr) : "taken over socket") << ":"
+                << serv_params.port << "\n\n";
     int i = 0;
     while (i < serv_params.q_time) {
         std::cout << "* Queuing time: " << i << " s" << '\r' << std::flush;
@@ -151,19 +322,24 @@ void print_debugging_message() {
 
 /*
  * Helper method to convert UNIX timestamp to required time format for logging.
- * With no argument given returns current date and time.
+ * Every thread remembers the last two stamps it converted (arrival and current
+ * time of its requests), so it formats each second once.
  */
-const std::string get_time_for_logging(time_t stamp=time(0)) {
-    char t[50];
-    strftime(t, sizeof(t), "%d/%b/%Y:%X %z", localtime(&stamp));
-    return t;
-}
-
- /* Helper method to convert UNIX timestamp to GMT time representation */
-const std::string get_time_in_gmt(time_t stamp=time(0)) {
-    char t[50];
-    strftime(t, sizeof(t), "%a, %d %h %Y %T GMT", gmtime(&stamp));
-    return t;
+void get_time_for_logging(time_t stamp, char * out) {
+    static thread_local time_t stamps[2] = {-1, -1};
+    static thread_local char texts[2][LOG_DATE_LENGTH];
+    static thread_local int last = 0;
+    for (int i=0; i<2; i++) {
+        if (stamps[i] == stamp) {
+            memcpy(out, texts[i], LOG_DATE_LENGTH);
+            return;
+        }
+    }
+    struct tm t;
+    last ^= 1;
+    strftime(texts[last], LOG_DATE_LENGTH, "%d/%b/%Y:%X %z", localtime_r(&stamp, &t));
+    stamps[last] = stamp;
+    memcpy(out, texts[last], LOG_DATE_LENGTH);
 }
 
 /* Helper method to extract IP address as a string from sockaddr_in structure */
@@ -187,48 +363,117 @@ const char * get_status_as_string(int code) {
     switch (code) {
         case HTTP_STATUS_CODE_OK:
             return HTTP_STATUS_CODE_OK_S;
+        case HTTP_STATUS_CODE_PARTIAL:
+            return HTTP_STATUS_CODE_PARTIAL_S;
+        case HTTP_STATUS_CODE_NOT_MODIFIED:
+            return HTTP_STATUS_CODE_NOT_MODIFIED_S;
         case HTTP_STATUS_CODE_NOTFOUND:
             return HTTP_STATUS_CODE_NOTFOUND_S;
+        case HTTP_STATUS_CODE_RANGE:
+            return HTTP_STATUS_CODE_RANGE_S;
+        case HTTP_STATUS_CODE_UNAVAILABLE:
+            return HTTP_STATUS_CODE_UNAVAILABLE_S;
     }
     return HTTP_STATUS_CODE_BAD_REQUEST_S;
 }
 
+/* Helper method returns MIME type for Content-Type header or NULL */
+const char * get_mime_type(extension type) {
+    switch (type) {
+        case HTML:
+            return TYPE_MIME_TEXT_HTML;
+        case JPEG:
+            return TYPE_MIME_IMAGE_JPEG;
+        case TEXT:
+            return TYPE_MIME_TEXT_PLAIN;
+        case JSON:
+            return TYPE_MIME_APPLICATION_JSON;
+        default:
+            return NULL;
+    }
+}
+
 /*
  * Helper method substitutes ~ with current user's home directory path + /myhttpd
  * If requested path doesn't start with ~ then appends server's root directory to it
  */
-std::string normalize_path(char const * page) {
-    std::string normalized(page);
-    if (normalized.front() == '~') {
-        normalized.erase(0, 1);
-        normalized.insert(0, "/myhttpd");
-        normalized.insert(0, getpwuid(getuid())->pw_dir);
+void normalize_path(char const * page, std::string & normalized) {
+    if (page[0] == '~') {
+        /* Home directory does not change while the server runs */
+        static const std::string home = std::string(getpwuid(getuid())->pw_dir) + "/myhttpd";
+        normalized.assign(home).append(page + 1);
     }
-    else if (!strlen(page) || page[0] != '/')
-        return "";
-    else normalized.insert(0, ".");
-    return normalized;
+    else if (page[0] != '/') normalized.clear();
+    else normalized.assign(".").append(page);
 }
 
-/* Helper method returns size of SERVER_INDEX_FILE or requested directory */
-off_t get_filesize(std::string * norm_path) {
-    struct stat f_info;
-    f_info.st_size = 0;
-    /* Try to get stat for requested file */
-    if (!stat(norm_path->c_str(), &f_info)) {
-        off_t dir_size = f_info.st_size;
-        /* Check whether file is directory */
-        if (S_ISDIR(f_info.st_mode)) {
-            if (norm_path->back() != '/') norm_path->append("/");
-            if (!stat((*norm_path + SERVER_INDEX_FILE).c_str(), &f_info)) {
-                norm_path->append(SERVER_INDEX_FILE);
-                return f_info.st_size;
-            }
-            return dir_size;
-        }
-        else return f_info.st_size;
+/*
+ * Helper method gives reused response the state of a new one. Fields are set
+ * one by one instead of assigning a new object, so the vector of parts keeps
+ * its capacity and the header buffer is not copied.
+ */
+static void reset_response(http_response & resp) {
+    resp.content_length = 0;
+    resp.header_len = 0;
+    resp.content_type = UNKNOWN;
+    resp.last_modified = NULL;
+    resp.content = NULL;
+    resp.cached.reset();
+    resp.file_fd = -1;
+    resp.body_offset = 0;
+    resp.parts.clear();
+    resp.part_text = NULL;
+    resp.etag_len = 0;
+    resp.content_range_len = 0;
+    resp.sent = 0;
+    resp.send_ns = 0;
+    resp.mod_time = 0;
+    resp.req_status = 0;
+    resp.keep_alive = resp.head = false;
+    resp.gzip = resp.vary = false;
+}
+
+/*
+ * Helper method fills request object of the connection for the head parsed on
+ * con_fd. Fields point into the connection buffer, nothing is copied. Runs on
+ * the reactor, so the size for the scheduler comes from the cache or the path
+ * index and no system call is made.
+ */
+void init_request(http_request * request, int con_fd, const RequestParser & parser, const char * rem_ip) {
+    request->con_fd = con_fd;
+    request->method = parser.method.data;
+    request->page = parser.target.data;
+    request->http = parser.version.data;
+    request->parsed = &parser;
+    normalize_path(request->page, request->norm_path);
+    if ((request->f_size = file_cache.size_hint(request->norm_path)) == -1)
+        request->f_size = path_index.size_hint(request->norm_path);
+    request->timestamp = server_clock.now();
+    request->arrival_ns = monotonic_ns();
+    request->rem_ip = rem_ip;
+    request->client_addr = 0;
+    request->keep_alive = wants_keep_alive(parser);
+    request->malformed = false;
+    request->con = NULL;
+    reset_response(request->response);
+    request->prepared = false;
+    request->scratch.clear();
+}
+
+/*
+ * Helper method decides whether client wants connection to stay open. HTTP/1.1
+ * connections are persistent unless client sends "Connection: close", HTTP/1.0
+ * ones only if client sends "Connection: keep-alive".
+ */
+bool wants_keep_alive(const RequestParser & parser) {
+    bool http11 = parser.version.equals(HTTP_VERSION_1_1_S);
+    if (!http11 && !parser.version.equals(HTTP_VERSION_1_0_S)) return false;
+    for (int i=0; i<parser.header_count; i++) {
+        if (!parser.headers[i].name.equals("Connection")) continue;
+        if (strcasestr(parser.headers[i].value.data, "close")) return false;
+        if (strcasestr(parser.headers[i].value.data, "keep-alive")) return true;
     }
-    return 0;
+    return http11;
 }
 
 /* Helper method returns extension of a file provided through path argument */
@@ -240,238 +485,515 @@ extension get_file_extension(const char * path) {
     return UNKNOWN;
 }
 
+/* Renders header templates, called once at startup */
+void init_header_templates() {
+    for (size_t i=0; i<HTTP_STATUS_COUNT; i++) {
+        for (int type=HTML; type<=UNKNOWN; type++) {
+            header_template & t = header_templates[i][type];
+            const char * mime = get_mime_type((extension) type);
+            t.len = snprintf(t.text, sizeof(t.text), "%s %s\r\nServer: %s\r\n%s%s%s",
+                             SERVER_HTTP_PROTOCOL_VERSION, get_status_as_string(http_status_codes[i]),
+                             SERVER_INFO, mime ? "Content-Type: " : "", mime ? mime : "", mime ? "\r\n" : "");
+        }
+    }
+}
+
+/* Helper method appends string to the header being built */
+static inline char * append(char * p, const char * str, size_t len) {
+    memcpy(p, str, len);
+    return p + len;
+}
+
+/*
+ * Builds response header into resp.header from the pre-rendered template of its
+ * status and type, the Date value kept by the clock and per-response fields.
+ * Does not allocate memory.
+ */
 void build_response_header(http_response & resp) {
-    std::stringstream header;
-    header << SERVER_HTTP_PROTOCOL_VERSION << " " << get_status_as_string(resp.req_status) << '\n';
-    header << "Date: " << get_time_in_gmt() << '\n';
-    header << "Server: " << SERVER_INFO << '\n';
-    if (resp.mod_time)
-        header << "Last-Modified: " << get_time_in_gmt(resp.mod_time) << '\n';
-    if (!resp.content_type.empty())
-        header << "Content-Type: " << resp.content_type << '\n';
-    if (resp.content_length)
-        header << "Content-Length: " << resp.content_length << '\n';
-    header << '\n';
-    resp.header = header.str();
+    size_t status = 0;
+    while (status < HTTP_STATUS_COUNT && http_status_codes[status] != resp.req_status) status++;
+    /* Unknown statuses are answered as Bad Request, like get_status_as_string() does */
+    if (status == HTTP_STATUS_COUNT) status = 1;
+    const header_template & t = header_templates[status][resp.content_type];
+    char * p = append(resp.header, t.text, t.len);
+    if (!resp.parts.empty()) p = append(p, "Content-Type: " RANGE_MULTIPART_TYPE "\r\n", 16 + strlen(RANGE_MULTIPART_TYPE));
+    p = append(p, "Date: ", 6);
+    server_clock.http_date(p);
+    p = append(p + HTTP_DATE_LENGTH, "\r\n", 2);
+    if (resp.mod_time) {
+        p = append(p, "Last-Modified: ", 15);
+        if (resp.last_modified) memcpy(p, resp.last_modified, HTTP_DATE_LENGTH);
+        else {
+            char date[HTTP_DATE_LENGTH + 1];
+            format_http_date(resp.mod_time, date);
+            memcpy(p, date, HTTP_DATE_LENGTH);
+        }
+        p = append(p + HTTP_DATE_LENGTH, "\r\n", 2);
+    }
+    if (resp.etag_len) {
+        p = append(p, "ETag: ", 6);
+        p = append(p, resp.etag, resp.etag_len);
+        p = append(p, "\r\nAccept-Ranges: bytes\r\n", 24);
+    }
+    if (resp.content_range_len) {
+        p = append(p, "Content-Range: ", 15);
+        p = append(p, resp.content_range, resp.content_range_len);
+        p = append(p, "\r\n", 2);
+    }
+    /* Persistent connection needs the length to find the end of an empty body, 304 has none by definition */
+    if (resp.req_status != HTTP_STATUS_CODE_NOT_MODIFIED && (resp.content_length || (resp.keep_alive && !resp.head))) {
+        char digits[16];
+        int n = 0;
+        unsigned int length = resp.content_length;
+        do digits[n++] = '0' + length % 10; while (length /= 10);
+        p = append(p, "Content-Length: ", 16);
+        while (n) *p++ = digits[--n];
+        p = append(p, "\r\n", 2);
+    }
+    if (resp.req_status == HTTP_STATUS_CODE_UNAVAILABLE)
+        p = append(p, "Retry-After: " SERVER_RETRY_AFTER "\r\n", 15 + strlen(SERVER_RETRY_AFTER));
+    if (resp.vary) p = append(p, "Vary: Accept-Encoding\r\n", 23);
+    if (resp.gzip) p = append(p, "Content-Encoding: gzip\r\n", 24);
+    if (resp.keep_alive) p = append(p, "Connection: keep-alive\r\n\r\n", 26);
+    else p = append(p, "Connection: close\r\n\r\n", 21);
+    resp.header_len = p - resp.header;
 }
 
 /*
- * Helper method fills up resp.content with content of requested file or with
- * content of directory in HTML format.
+ * Helper method opens requested file into resp.file_fd or fills up resp.content
+ * with content of directory in HTML format. A directory is answered with its
+ * SERVER_INDEX_FILE if it has one.
  */
 void get_file_content(http_request *req, http_response &resp) {
     struct stat f_info;
-    std::ifstream in_f;
+    bool get = get_method_as_int(req->method) == HTTP_REQUEST_GET;
     /* Check if path is an empty string */
     if (req->norm_path.empty()) {
         resp.req_status = HTTP_STATUS_CODE_BAD_REQUEST;
         return;
     }
-    /* Get stat for a file */
-    stat(req->norm_path.c_str(), &f_info);
+    /* Cached file is answered without stat or read, one known by metadata only is opened */
+    if ((resp.cached = file_cache.lookup(req->norm_path))) {
+        if (resp.cached->data || !get
+            || (resp.file_fd = open(resp.cached->path.c_str(), O_RDONLY | O_CLOEXEC)) != -1) {
+            if (get) resp.content_length = resp.cached->size;
+            resp.content_type = resp.cached->content_type;
+            resp.req_status = HTTP_STATUS_CODE_OK;
+            resp.mod_time = resp.cached->mtime;
+            resp.last_modified = resp.cached->last_modified;
+            struct stat c_info;
+            memset(&c_info, 0, sizeof(c_info));
+            c_info.st_mode = resp.cached->type;
+            c_info.st_size = resp.cached->file_size;
+            c_info.st_mtime = resp.cached->mtime;
+            c_info.st_mtim.tv_nsec = resp.cached->mtime_ns;
+            c_info.st_ino = resp.cached->ino;
+            negotiate_gzip(req, resp, resp.cached->path, c_info);
+            set_etag(resp, c_info);
+            return;
+        }
+        resp.cached.reset();
+    }
+    /* Path index knows the file and its stat, others are looked up on disk. Strings keep their capacity in the thread */
+    static thread_local path_info found;
+    std::string & path = found.path;
+    bool indexed = path_index.lookup(req->norm_path, found);
+    if (indexed) f_info = found.info;
+    else if (stat(path.assign(req->norm_path).c_str(), &f_info)) {
+        resp.req_status = HTTP_STATUS_CODE_NOTFOUND;
+        return;
+    }
+    if (!indexed && S_ISDIR(f_info.st_mode)) {
+        std::string index = path + (path.back() == '/' ? "" : "/") + SERVER_INDEX_FILE;
+        struct stat i_info;
+        if (!stat(index.c_str(), &i_info) && S_ISREG(i_info.st_mode)) {
+            path = index;
+            f_info = i_info;
+        }
+    }
     /* If openned file is a directory then get list of files */
     if (S_ISDIR(f_info.st_mode)) {
-        if (get_method_as_int(req->method) == HTTP_REQUEST_GET) {
-            std::stringstream listing;
-            int dir;
-            struct dirent **item;
-            dir = scandir(req->norm_path.c_str(), &item, NULL, alphasort);
-            listing << "<html>\n<head><title>Directory Listing</title></head>\n<body>\n"
-                    << "<h2>Listing of " << req->page << ":</h2><br>\n";
-            for(int i=0; i<dir; i++) {
-                if (item[i]->d_name[0] != '.') {
-                    listing << item[i]->d_name << "<br>\n";
-                }
-                free(item[i]);
+        resp.mod_time = f_info.st_mtime;
+        /* Rendered listing is cached under the directory until its mtime changes */
+        if (get) {
+            size_t size;
+            char * listing = render_listing(path.c_str(), req->page, serv_params.listing_max, size);
+            if (!listing) {
+                resp.req_status = HTTP_STATUS_CODE_NOTFOUND;
+                return;
+            }
+            resp.content_length = size;
+            resp.content_type = HTML;
+            if ((resp.cached = file_cache.insert_bytes(req->norm_path, path, listing, size, f_info, HTML))) {
+                negotiate_gzip(req, resp, path, f_info);
+                set_etag(resp, f_info);
             }
-            free(item);
-            listing << "</body>\n</html>\n";
-            resp.content_length = listing.str().length();
-            resp.content = new char[resp.content_length];
-            strcpy(resp.content, listing.str().c_str());
-            resp.content_type = TYPE_MIME_TEXT_HTML;
+            else resp.content = listing;
         }
         resp.req_status = HTTP_STATUS_CODE_OK;
-        resp.mod_time = f_info.st_mtimespec.tv_sec;
     }
     /* Its a file */
     else if (S_ISREG(f_info.st_mode)) {
-        switch(get_file_extension(req->norm_path.c_str())){
-            case HTML:
-                in_f.open(req->norm_path);
-                if (!in_f.is_open()) {
-                    resp.req_status = HTTP_STATUS_CODE_NOTFOUND;
-                    break;
-                }
-                if (get_method_as_int(req->method) == HTTP_REQUEST_GET) {
-                    resp.content = new char[f_info.st_size];
-                    in_f.read(resp.content, f_info.st_size);
-                    resp.content_length = f_info.st_size;
-                }
-                resp.content_type = TYPE_MIME_TEXT_HTML;
-                resp.req_status = HTTP_STATUS_CODE_OK;
-                resp.mod_time = f_info.st_mtimespec.tv_sec;
-                break;
-            case JPEG:
-                in_f.open(req->norm_path, std::ios::binary);
-                if (!in_f.is_open()) {
-                    resp.req_status = HTTP_STATUS_CODE_NOTFOUND;
-                    break;
-                }
-                if (get_method_as_int(req->method) == HTTP_REQUEST_GET) {
-                    resp.content = new char[f_info.st_size];
-                    in_f.read(resp.content, f_info.st_size);
-                    resp.content_length = f_info.st_size;
-                }
-                resp.content_type = TYPE_MIME_IMAGE_JPEG;
-                resp.req_status = HTTP_STATUS_CODE_OK;
-                resp.mod_time = f_info.st_mtimespec.tv_sec;
-                break;
-            default:
-                resp.req_status = HTTP_STATUS_CODE_BAD_REQUEST;
-        in_f.close();
+        extension content_type = indexed ? found.content_type : get_file_extension(path.c_str());
+        if (content_type == UNKNOWN) {
+            resp.req_status = HTTP_STATUS_CODE_BAD_REQUEST;
+            return;
         }
+        /* Only descriptor is kept, worker streams the file straight into the socket */
+        if ((resp.file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) == -1) {
+            resp.req_status = HTTP_STATUS_CODE_NOTFOUND;
+            return;
+        }
+        /* Stat of the index may predate a write not yet picked up, size and validators come from the open file */
+        if (fstat(resp.file_fd, &f_info)) {
+            close(resp.file_fd);
+            resp.file_fd = -1;
+            resp.req_status = HTTP_STATUS_CODE_NOTFOUND;
+            return;
+        }
+        if (get) {
+            resp.content_length = f_info.st_size;
+            resp.cached = file_cache.insert(req->norm_path, path, resp.file_fd, f_info, content_type);
+        }
+        /* Descriptor is not needed if there is nothing to send or file bytes are in the cache now */
+        if (!resp.content_length || (resp.cached && resp.cached->data)) {
+            close(resp.file_fd);
+            resp.file_fd = -1;
+        }
+        resp.content_type = content_type;
+        resp.req_status = HTTP_STATUS_CODE_OK;
+        resp.mod_time = f_info.st_mtime;
+        negotiate_gzip(req, resp, path, f_info);
+        set_etag(resp, f_info);
     }
     else resp.req_status = HTTP_STATUS_CODE_NOTFOUND;
 }
 
-std::string get_logstring(http_request * req, http_response & resp) {
-        std::stringstream out;
-        out     << req->rem_ip << " ~ [" << get_time_for_logging(req->timestamp) << "] ["
-                << get_time_for_logging() << "] \"" << req->method << " " << req->page
-                << " " << req->http << "\" " << resp.req_status << " "
-                << resp.content_length << std::endl;
-        return out.str();
+/* Writes log line for the request into out, which must hold LOG_LINE_LENGTH bytes. Returns its length */
+size_t get_logstring(http_request * req, http_response & resp, char * out) {
+        char arrived[LOG_DATE_LENGTH], now[LOG_DATE_LENGTH];
+        get_time_for_logging(req->timestamp, arrived);
+        get_time_for_logging(server_clock.now(), now);
+        int len = snprintf(out, LOG_LINE_LENGTH, "%s ~ [%s] [%s] \"%s %s %s\" %d %u\n",
+                           req->rem_ip, arrived, now, req->method, req->page, req->http,
+                           resp.req_status, resp.content_length);
+        /* Line that did not fit still ends with a newline */
+        if (len >= LOG_LINE_LENGTH) {
+            len = LOG_LINE_LENGTH - 1;
+            out[len - 1] = '\n';
+        }
+        return len;
 }
 
-void Log::openlogfile(std::string path) {
-    this->_logfile.open(path, std::ios::app);
+/*
+ * Helper method blocks until non-blocking socket can take more data. Returns
+ * false if the client took nothing for the send timeout, so a slow reader
+ * holds a worker for that long at most.
+ */
+bool wait_writable(int sock_fd) {
+    struct pollfd pfd;
+    pfd.fd = sock_fd;
+    pfd.events = POLLOUT;
+    int ready, timeout = serv_params.send_timeout > 0 ? serv_params.send_timeout * 1000 : -1;
+    while ((ready = poll(&pfd, 1, timeout)) == -1)
+        if (errno != EINTR) return false;
+    return ready > 0;
 }
 
-void Log::execute(std::string log_str) {
-    std::lock_guard<std::mutex> lg(this->m);
-    if (serv_params.debugging)
-        std::cout << log_str;
-    else if (this->_logfile.is_open())
-        this->_logfile << log_str << std::flush;
+/* Helper method sends whole buffer, looping on partial writes */
+bool send_buffer(int sock_fd, const char * buf, size_t count, int flags) {
+    while (count) {
+        ssize_t sent = send(sock_fd, buf, count, MSG_NOSIGNAL | flags);
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent == -1 && errno == EAGAIN && wait_writable(sock_fd)) continue;
+        if (sent <= 0) return false;
+        buf += sent;
+        count -= sent;
+    }
+    return true;
 }
 
-void scheduling_thread() {
-    if (serv_params.debugging) print_debugging_message();
-    else sleep(serv_params.q_time);
-    std::vector<std::thread> pool;
-    /* Creating pool of threads, respecting condition variables,
-    mutexes and request slots */
-    for (int id=0; id<serv_params.threads; id++) {
-        mutex_wt.push_back(new std::mutex);
-        cv_wt.push_back(new std::condition_variable());
-        jobs.push_back(NULL);
-        pool.push_back(std::thread (worker_thread, id));
+/* Helper method sends buffers with one gathered write, looping on partial writes */
+bool send_buffers(int sock_fd, struct iovec * iov, int count) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    while (msg.msg_iovlen) {
+        ssize_t sent = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent == -1 && errno == EAGAIN && wait_writable(sock_fd)) continue;
+        if (sent <= 0) return false;
+        /* Skip fully sent buffers and move into the partially sent one */
+        while (msg.msg_iovlen && (size_t) sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
     }
-    while (true) {
-        /* Lock mutex */
-        std::unique_lock<std::mutex> mql(mutex_rq);
-        /* Wait for notification or when queue is not empty */
-        cv_rq.wait(mql, [](){return !request_queue->empty();});
-        /****************** Critical section ****************/
-        /* Get request at the front of the queue and pop it */
-        struct http_request * req = request_queue->top();
-        request_queue->pop();
-        /****************************************************/
-        mql.unlock();
-        /* Looking for a waiting thread */
-        for(int i=0;; i = (i+1) % serv_params.threads) {
-            if (jobs[i] == NULL) {
-                jobs[i] = req;
-                cv_wt[i]->notify_one();
-                break;
+    return true;
+}
+
+/* Helper method moves file pages into the socket through a per-thread pipe */
+bool splice_file(int sock_fd, int file_fd, off_t offset, size_t count) {
+    static thread_local int pipe_fd[2] = {-1, -1};
+    if (pipe_fd[0] == -1 && pipe2(pipe_fd, O_CLOEXEC) == -1)
+        return false;
+    while (count) {
+        ssize_t in = splice(file_fd, &offset, pipe_fd[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in == -1 && errno == EINTR) continue;
+        if (in <= 0) return false;
+        count -= in;
+        while (in) {
+            ssize_t out = splice(pipe_fd[0], NULL, sock_fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out == -1 && errno == EINTR) continue;
+            if (out == -1 && errno == EAGAIN && wait_writable(sock_fd)) continue;
+            /* Pipe still holds unsent bytes, it can not be reused */
+            if (out <= 0) {
+                close(pipe_fd[0]);
+                close(pipe_fd[1]);
+                pipe_fd[0] = pipe_fd[1] = -1;
+                return false;
             }
-            /* If all threads are busy sleep for 200us */
-            else if (i == serv_params.threads-1)
-                usleep(200);
+            in -= out;
         }
     }
+    return true;
 }
 
-void worker_thread(int id) {
-    while(true) {
-        std::unique_lock<std::mutex> w_locker(*mutex_wt[id]);
-        cv_wt[id]->wait(w_locker, [=](){return jobs[id] != NULL;});
-        struct http_response resp;
-        switch (get_method_as_int(jobs[id]->method)) {
-            case HTTP_REQUEST_GET:
-            case HTTP_REQUEST_HEAD:
-            get_file_content(jobs[id], resp);
-            break;
-            default:
-            resp.req_status = HTTP_STATUS_CODE_BAD_REQUEST;
-        }
-        build_response_header(resp);
-        send(jobs[id]->con_fd, resp.header.c_str(), strlen(resp.header.c_str()), 0);
-        if (resp.content_length) {
-            send(jobs[id]->con_fd, resp.content, resp.content_length, 0);
-            delete [] resp.content;
-            resp.content = NULL;
-        }
-        logging.execute(get_logstring(jobs[id], resp));
-        close(jobs[id]->con_fd);
-        delete jobs[id];
-        jobs[id] = NULL;
-    }
-}
-
-/* Queuing thread */
-int main(int argc, char * argv[]) {
-    request_queue = new std::priority_queue<http_request *, std::vector<http_request *>,
-                        std::function<bool(http_request *, http_request *)>>(compare_time);
-    /* Parsing command line arguments */
-    parse_args(argc, argv);
-    /* Run as daemon if not in debugging mode */
-    if (!serv_params.debugging) daemon_mode();
-    /* Changing root directory for the server */
-    chdir(serv_params.root_dir.c_str());
-    /* Open logfile if given */
-    if (!serv_params.logfile.empty()) {
-        try { logging.openlogfile(serv_params.logfile); }
-        catch (...) {
-        pr_error("failed open logfile");
+/*
+ * Helper method sends count bytes of file starting at offset without copying
+ * them through user space. Falls back to splice() if sendfile() is not supported
+ * for the file.
+ */
+bool send_file(int sock_fd, int file_fd, off_t offset, size_t count) {
+    while (count) {
+        ssize_t sent = sendfile(sock_fd, file_fd, &offset, count);
+        if (sent > 0) {
+            count -= sent;
+            continue;
         }
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent == -1 && errno == EAGAIN && wait_writable(sock_fd)) continue;
+        if (sent == -1 && (errno == EINVAL || errno == ENOSYS))
+            return splice_file(sock_fd, file_fd, offset, count);
+        /* Peer has gone or file was truncated while sending */
+        return false;
     }
-    create_socket_open_port();
-    /* Creating scheduling thread */
-    std::thread scheduler(scheduling_thread);
-    /* Accepting and queuing requests */
+    return true;
+}
+
+/*
+ * Holds requests in the queues for the queuing time and then starts the
+ * workers. Cache is warmed after that while requests are served, unless it was
+ * warmed before the listening sockets were taken over.
+ */
+void scheduling_thread(std::vector<WorkerPool *> pools, bool warm) {
+    if (serv_params.debugging) print_debugging_message();
+    else sleep(serv_params.q_time);
+    for (size_t i=0; i<pools.size(); i++) pools[i]->start();
+    if (serv_params.threads_min) std::thread(adapt_thread, pools).detach();
+    if (warm) warm_cache(serv_params.warmup);
+}
+
+/* Resizes adaptive pools by their load */
+void adapt_thread(std::vector<WorkerPool *> pools) {
     while (true) {
-        char    header[HEAD_LINE_LENGTH] = {'\0'}, method[METHOD_LENGTH] = {'\0'},
-                page[PAGE_LENGTH] = {'\0'}, http[HTTP_LENGTH] = {'\0'};
-
-        con_fd = accept(socket_fd, (struct sockaddr *) &con_info, &con_socklen);
-        recv(con_fd, header, HEAD_LINE_LENGTH, 0);
-        sscanf(header, "%5s %1024s %8s", method, page, http);
-        /* Creating object that represents client request*/
-        struct http_request * request = new http_request();
-        request->con_fd = con_fd;
-        request->norm_path = normalize_path(page);
-        request->f_size = get_filesize(&request->norm_path);
-        request->timestamp = time(0);
-        strcpy(request->method, method);
-        strcpy(request->page, page);
-        strcpy(request->http, http);
-        strcpy(request->rem_ip, get_ip(&con_info).c_str());
-        /* Lock mutex */
-        std::unique_lock<std::mutex> mql(mutex_rq);
-        /************* Critical section ***********/
-        /* Put request object into the main queue */
-        request_queue->push(request);
-        /******************************************/
-        mql.unlock();
-        /* Notify scheduler thread that there is a new request in the main queue */
-        cv_rq.notify_one();
-    }
-    scheduler.join();
-    /* Cleaning up */
-    close(socket_fd);
-    freeaddrinfo(socket_info);
-
-    return EXIT_SUCCESS;
+        std::this_thread::sleep_for(std::chrono::milliseconds(POOL_ADAPT_MS));
+        for (size_t i=0; i<pools.size(); i++) pools[i]->adapt(i);
+    }
+}
+
+/* Runs event loop of one acceptor, bound to the CPU of its shard unless it is -1 */
+void run_acceptor(Reactor * reactor, int cpu) {
+    pin_thread(cpu);
+    reactor->run();
+}
+
+/* Helper method fills up resp.content with the server status page */
+void get_status_content(http_request * req, http_response & resp) {
+    const char * query = strchr(req->page, '?');
+    bool json = query && strstr(query, "json");
+    if (!resp.head) {
+        std::string page = server_stats.render(json);
+        resp.content_length = page.length();
+        resp.content = new char[resp.content_length];
+        memcpy(resp.content, page.data(), resp.content_length);
+    }
+    resp.content_type = json ? JSON : TEXT;
+    resp.req_status = HTTP_STATUS_CODE_OK;
+}
+
+/* Finds content for the request and builds the response header, timing both */
+void prepare_response(http_request * req, http_response & resp, uint64_t start) {
+    resp.keep_alive = req->keep_alive;
+    resp.head = get_method_as_int(req->method) == HTTP_REQUEST_HEAD;
+    /* Head the parser rejected is answered without looking at its fields */
+    switch (req->malformed ? -1 : get_method_as_int(req->method)) {
+        case HTTP_REQUEST_GET:
+        case HTTP_REQUEST_HEAD:
+        if (is_status_request(req->page)) get_status_content(req, resp);
+        else {
+            get_file_content(req, resp);
+            check_conditions(req, resp);
+        }
+        break;
+        default:
+        resp.req_status = HTTP_STATUS_CODE_BAD_REQUEST;
+    }
+    uint64_t built = monotonic_ns();
+    server_stats.record(STAGE_CONTENT, built - start);
+    build_response_header(resp);
+    server_stats.record(STAGE_HEADER, monotonic_ns() - built);
+}
+
+/*
+ * Sends response from resp.sent on, at most limit bytes of it unless limit is 0.
+ * The header always goes out whole. Returns false if the peer has gone.
+ */
+bool send_response(int sock_fd, http_response & resp, size_t limit) {
+    size_t total = resp.header_len + resp.content_length;
+    size_t end = limit ? std::min(total, std::max(resp.sent + limit, resp.header_len)) : total;
+    size_t from = std::max(resp.sent, resp.header_len);
+    bool ok = true;
+    if (!resp.parts.empty()) ok = send_parts(sock_fd, resp, end);
+    /* File follows the header, MSG_MORE lets both leave in the same segments */
+    else if (resp.content_length && resp.file_fd != -1) {
+        if (resp.sent < resp.header_len)
+            ok = send_buffer(sock_fd, resp.header + resp.sent, resp.header_len - resp.sent,
+                             end > resp.header_len ? MSG_MORE : 0);
+        if (ok && end > from)
+            ok = send_file(sock_fd, resp.file_fd, resp.body_offset + from - resp.header_len, end - from);
+    }
+    /* Header and body from memory go out with one system call */
+    else {
+        struct iovec iov[2];
+        ok = send_buffers(sock_fd, iov, response_buffers(resp, end, iov));
+    }
+    resp.sent = end;
+    return ok;
+}
+
+/*
+ * Points iov at the unsent part of a response held in memory, header and body
+ * up to byte end of the response. Returns number of buffers, at most 2.
+ */
+int response_buffers(http_response & resp, size_t end, struct iovec * iov) {
+    size_t from = std::max(resp.sent, resp.header_len);
+    int n = 0;
+    if (resp.sent < resp.header_len) {
+        iov[n].iov_base = resp.header + resp.sent;
+        iov[n++].iov_len = resp.header_len - resp.sent;
+    }
+    if (end > from) {
+        iov[n].iov_base = (resp.cached ? resp.cached->data : resp.content) + resp.body_offset + from - resp.header_len;
+        iov[n++].iov_len = end - from;
+    }
+    return n;
+}
+
+/*
+ * Helper method sends multipart body up to byte end of the response. Part
+ * headers come from resp.part_text, ranges from the file or the cached data.
+ */
+bool send_parts(int sock_fd, http_response & resp, size_t end) {
+    bool ok = true;
+    if (resp.sent < resp.header_len)
+        ok = send_buffer(sock_fd, resp.header + resp.sent, resp.header_len - resp.sent,
+                         end > resp.header_len ? MSG_MORE : 0);
+    size_t pos = resp.header_len;
+    for (size_t i=0; ok && i<resp.parts.size() && pos < end; i++) {
+        const body_part & part = resp.parts[i];
+        size_t from = std::max(resp.sent, pos), to = std::min(end, pos + part.len);
+        pos += part.len;
+        if (from >= to) continue;
+        off_t offset = part.offset + from - (pos - part.len);
+        if (part.text) ok = send_buffer(sock_fd, resp.part_text + offset, to - from, to < end ? MSG_MORE : 0);
+        else if (resp.file_fd != -1) ok = send_file(sock_fd, resp.file_fd, offset, to - from);
+        else ok = send_buffer(sock_fd, resp.cached->data + offset, to - from, to < end ? MSG_MORE : 0);
+    }
+    return ok;
+}
+
+/*
+ * Releases response resources, writes log line and hands connection back to
+ * the reactor. The request belongs to the connection and must not be touched
+ * after that.
+ */
+void finish_request(http_request * req, http_response & resp, bool sent) {
+    req->con->owner->release(req->con, complete_request(req, resp, sent));
+}
+
+/*
+ * Releases response resources and records and logs the request, on the
+ * thread that sent it. Returns whether the connection stays open.
+ */
+bool complete_request(http_request * req, http_response & resp, bool sent) {
+    if (resp.file_fd != -1) close(resp.file_fd);
+    resp.file_fd = -1;
+    delete [] resp.content;
+    resp.content = NULL;
+    server_stats.record(STAGE_SEND, resp.send_ns);
+    server_stats.record(STAGE_TOTAL, monotonic_ns() - req->arrival_ns);
+    server_stats.finished(resp.req_status, sent ? resp.sent : 0);
+    if (logging.is_enabled()) {
+        char line[LOG_LINE_LENGTH];
+        logging.execute(line, get_logstring(req, resp, line));
+    }
+    /* Idle connection does not pin the cached entry */
+    resp.cached.reset();
+    return resp.keep_alive && sent;
+}
+
+/*
+ * Answers request with 503 and Retry-After and closes its connection, without
+ * looking at the file. Called when the request is shed by the reactor or by
+ * a worker; the response is sent with one non-blocking write.
+ */
+void reject_request(http_request * req) {
+    http_response & resp = req->response;
+    uint64_t start = monotonic_ns();
+    req->prepared = true;
+    resp.req_status = HTTP_STATUS_CODE_UNAVAILABLE;
+    resp.content_type = UNKNOWN;
+    resp.keep_alive = false;
+    build_response_header(resp);
+    ssize_t sent = send(req->con_fd, resp.header, resp.header_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    resp.sent = sent > 0 ? sent : 0;
+    resp.send_ns = monotonic_ns() - start;
+    finish_request(req, resp, resp.sent == resp.header_len);
+}
+
+/*
+ * Serves one request and hands its connection back to the reactor, which keeps
+ * it open for the next request or closes it. Runs on a worker thread. A policy
+ * with a quantum gets the request back into the queue after every quantum.
+ */
+void handle_request(http_request * req) {
+    http_response & resp = req->response;
+    uint64_t start = monotonic_ns();
+    if (!req->prepared) {
+        server_stats.record(STAGE_QUEUE, start - req->arrival_ns);
+        prepare_response(req, resp, start);
+        req->prepared = true;
+        /* Reactor on a ring sends a response held in memory itself, the worker is free at once */
+        if (req->con->owner->send_later(req->con)) return;
+        start = monotonic_ns();
+    }
+    bool sent = send_response(req->con_fd, resp, scheduling_policy->quantum());
+    resp.send_ns += monotonic_ns() - start;
+    if (sent && resp.sent < resp.header_len + resp.content_length) {
+        req->pool->submit(req);
+        return;
+    }
+    finish_request(req, resp, sent);
+}
+
+/* Writes server counters to standard error, triggered by SIGUSR1 */
+void report_stats() {
+    std::cerr << server_stats.summary() << file_cache.stats() << gzip_cache.stats() << path_index.stats() << logging.stats() << std::flush;
 }
@@ -10,6 +10,9 @@
 #include <vector>
 #include <queue>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
 #include <sys/stat.h>   // stat systemcall
 #include <unistd.h>     // gethostname() gethostbyname()
 #include <time.h>       // time functions
@@ -19,23 +22,50 @@
 #include <arpa/inet.h>  // inet functions
 #include <dirent.h>     // dirscan function
 #include <pwd.h>        // needed to get a path of user's homedirectory
+#include <pthread.h>    // thread affinity
+#include <sched.h>      // cpu_set_t
+#include <fcntl.h>      // open() flags
+#include <signal.h>     // ignoring SIGPIPE
+#include <sys/sendfile.h> // zero-copy file sending
+#include <poll.h>       // waiting for writable sockets
+#include <sys/uio.h>    // iovec for gathered writes
+#include <cerrno>
+#include "clock.h"
+#include "log.h"
+#include "parser.h"
 
 /* Server settings */
 #define SERVER_INFO                         "myhttpd/0.0.1"
-#define SERVER_HTTP_PROTOCOL_VERSION        "HTTP/1.0"
+#define SERVER_HTTP_PROTOCOL_VERSION        "HTTP/1.1"
 #define SERVER_DEFAULT_PORT                 "8080"
 #define SERVER_DEFAULT_ROOT_DIR             ""
-#define SERVER_DEFAULT_Q_TIME               60
+#define SERVER_DEFAULT_Q_TIME               0
 #define SERVER_DEFAULT_N_THREADS            4
-#define SERVER_DEFAULT_FCFS                 true
+#define SERVER_DEFAULT_POLICY               "FCFS"
+#define SERVER_DEFAULT_AGING_RATE           (1 << 20)   // bytes per second of waiting taken off a size under SJF
 #define SERVER_DEFAULT_DEBUGGING            false
+#define SERVER_DEFAULT_KEEPALIVE_TIMEOUT    5
+#define SERVER_DEFAULT_KEEPALIVE_MAX        100
+#define SERVER_DEFAULT_HEADER_TIMEOUT       10          // seconds from first byte to complete request head
+#define SERVER_DEFAULT_SEND_TIMEOUT         60          // seconds a response may wait for the client to take bytes
+#define SERVER_DEFAULT_CACHE_SIZE           (64 << 20)
+#define SERVER_DEFAULT_GZIP_CACHE_SIZE      (16 << 20)
+#define SERVER_DEFAULT_ACCEPTORS            1
+#define SERVER_DEFAULT_LISTING_MAX          10000       // names shown in a directory listing, 0 for LISTING_MAX_NAMES
+#define SERVER_DEFAULT_QUEUE_MAX            0           // requests waiting for a worker per shard, 0 is unbounded
+#define SERVER_DEFAULT_QUEUE_WAIT           0           // ms a request may wait for a worker, 0 is unbounded
+#define SERVER_DEFAULT_CODEL_TARGET         0           // ms of queuing delay CoDel keeps to, 0 disables it
+#define SERVER_DEFAULT_FAIR_PREFIX          0           // address bits a client is told apart by, 0 disables fair queuing
+#define SERVER_DEFAULT_CLIENT_CAP           0           // requests of a client served at once, 0 is unbounded
+#define SERVER_RETRY_AFTER                  "1"         // seconds a shed client is asked to wait
 #define SERVER_INDEX_FILE                   "index.html"
 
-/* Limits for 1st line */
-#define HEAD_LINE_LENGTH                    1040
-#define METHOD_LENGTH                       6       // 5 + EOL
-#define PAGE_LENGTH                         1025    // 1024 + EOL
-#define HTTP_LENGTH                         9      // 8 + EOL
+/* Limit for request line and headers received on a connection */
+#define CON_BUFFER_LENGTH                   8192
+
+/* Protocol versions */
+#define HTTP_VERSION_1_0_S                  "HTTP/1.0"
+#define HTTP_VERSION_1_1_S                  "HTTP/1.1"
 
 /* Accepting methods as string */
 #define HTTP_REQUEST_GET_S                  "GET"
@@ -47,82 +77,177 @@
 
 /* Status codes as integers */
 #define HTTP_STATUS_CODE_OK                 200
+#define HTTP_STATUS_CODE_PARTIAL            206
+#define HTTP_STATUS_CODE_NOT_MODIFIED       304
 #define HTTP_STATUS_CODE_BAD_REQUEST        400
 #define HTTP_STATUS_CODE_NOTFOUND           404
+#define HTTP_STATUS_CODE_RANGE              416
+#define HTTP_STATUS_CODE_UNAVAILABLE        503
 
 /* Status codes as strings */
 #define HTTP_STATUS_CODE_OK_S               "200 OK"
+#define HTTP_STATUS_CODE_PARTIAL_S          "206 Partial Content"
+#define HTTP_STATUS_CODE_NOT_MODIFIED_S     "304 Not Modified"
 #define HTTP_STATUS_CODE_BAD_REQUEST_S      "400 Bad Request"
 #define HTTP_STATUS_CODE_NOTFOUND_S         "404 Not Found"
+#define HTTP_STATUS_CODE_RANGE_S            "416 Range Not Satisfiable"
+#define HTTP_STATUS_CODE_UNAVAILABLE_S      "503 Service Unavailable"
+
+/* Room for a rendered response header */
+#define RESPONSE_HEADER_LENGTH              512
+#define HEADER_TEMPLATE_LENGTH              128
+#define HTTP_ETAG_LENGTH                    64
+#define CONTENT_RANGE_LENGTH                64
 
 /* Supported MIME types */
 #define TYPE_MIME_IMAGE_JPEG                "image/jpeg"
 #define TYPE_MIME_TEXT_HTML                 "text/html"
+#define TYPE_MIME_TEXT_PLAIN                "text/plain"
+#define TYPE_MIME_APPLICATION_JSON          "application/json"
 
 /* Structure holds default parameters of the server */
-static struct parameters {
+struct parameters {
     bool debugging = SERVER_DEFAULT_DEBUGGING;
     std::string port = SERVER_DEFAULT_PORT, logfile;
     std::string root_dir = SERVER_DEFAULT_ROOT_DIR;
     int q_time = SERVER_DEFAULT_Q_TIME;
     int threads = SERVER_DEFAULT_N_THREADS;
-    bool fcfs_policy = SERVER_DEFAULT_FCFS;
-} serv_params;
+    int threads_min = 0;                                // 0 keeps the number of threads fixed
+    std::string policy = SERVER_DEFAULT_POLICY;
+    size_t aging_rate = SERVER_DEFAULT_AGING_RATE;
+    int keepalive_timeout = SERVER_DEFAULT_KEEPALIVE_TIMEOUT;
+    unsigned int keepalive_max = SERVER_DEFAULT_KEEPALIVE_MAX;
+    int header_timeout = SERVER_DEFAULT_HEADER_TIMEOUT;
+    int send_timeout = SERVER_DEFAULT_SEND_TIMEOUT;
+    int acceptors = SERVER_DEFAULT_ACCEPTORS;
+    bool pin_cpus = false;
+    size_t listing_max = SERVER_DEFAULT_LISTING_MAX;
+    bool path_index = true;
+    bool io_uring = false;
+    size_t queue_max = SERVER_DEFAULT_QUEUE_MAX;
+    int queue_wait = SERVER_DEFAULT_QUEUE_WAIT;
+    int codel_target = SERVER_DEFAULT_CODEL_TARGET;
+    int fair_prefix = SERVER_DEFAULT_FAIR_PREFIX;
+    unsigned int client_cap = SERVER_DEFAULT_CLIENT_CAP;
+    std::string warmup;                             // manifest or log of files read into the cache at startup
+    std::string handover;                           // Unix socket listening sockets are handed over through
+};
 
-struct http_request {
-    int con_fd;
-    off_t f_size;
-    char page[PAGE_LENGTH], method[METHOD_LENGTH], http[HTTP_LENGTH];
-    std::string norm_path;
-    time_t timestamp;
-    char rem_ip[INET_ADDRSTRLEN];
+struct connection;
+struct cache_entry;
+struct fair_client;
+
+enum extension {
+    HTML,
+    JPEG,
+    TEXT,
+    JSON,
+    UNKNOWN
+};
+
+/* Piece of a multipart body: text in resp.part_text or bytes of the file or cached data */
+struct body_part {
+    bool text;
+    off_t offset;
+    size_t len;
 };
 
 struct http_response {
     unsigned int content_length = 0;
-    std::string header, content_type;
+    char header[RESPONSE_HEADER_LENGTH];
+    size_t header_len = 0;
+    extension content_type = UNKNOWN;
+    const char * last_modified = NULL;
     char * content = NULL;
+    std::shared_ptr<cache_entry> cached;
+    int file_fd = -1;
+    off_t body_offset = 0;                          // first byte of a single range in the file or cached data
+    std::vector<body_part> parts;                   // body of a multipart/byteranges response, else empty
+    const char * part_text = NULL;                  // part headers, in the request's scratch
+    char etag[HTTP_ETAG_LENGTH];                    // validator of a file body, set if etag_len is not 0
+    size_t etag_len = 0;
+    char content_range[CONTENT_RANGE_LENGTH];
+    size_t content_range_len = 0;
+    size_t sent = 0;                                // bytes of header and body sent so far
+    uint64_t send_ns = 0;                           // time spent sending, over all chunks
     time_t mod_time = 0;
     int req_status;
+    bool keep_alive = false, head = false;
+    bool gzip = false, vary = false;                // body is the gzip variant, type has variants
 };
 
-/* Class for thread-safe logging */
-class Log {
-public:
-    void execute(std::string);
-    void openlogfile(std::string);
-private:
-    std::mutex m;
-    std::ofstream _logfile;
+/*
+ * Request and its response. Every connection owns one and reuses it for each
+ * of its requests, so strings in it keep their capacity and serving a request
+ * allocates nothing once the connection has been used.
+ */
+struct http_request {
+    int con_fd;
+    off_t f_size;                                   // size known from the cache or -1, for the scheduler
+    const char * page, * method, * http;            // fields of the request line, in the connection buffer
+    const RequestParser * parsed;                   // request head, valid until the request is served
+    std::string norm_path;
+    time_t timestamp;
+    const char * rem_ip;
+    uint32_t client_addr;                           // peer address in host order, for fair queuing
+    struct fair_client * fair;                      // client queue the request was put into
+    bool keep_alive, malformed;
+    struct connection * con;
+    class WorkerPool * pool;
+    uint64_t arrival_ns;                            // monotonic arrival time
+    int64_t key;                                    // scheduling policy key
+    uint64_t seq;                                   // submit order, breaks ties between keys
+    struct http_response response;
+    bool prepared;                                  // response is built, a partly sent one is queued again
+    std::string scratch;                            // per-request text like multipart headers, keeps capacity
 };
 
-enum extension {
-    HTML,
-    JPEG,
-    UNKNOWN
-};
+/* Shared server state defined in myhttpd.cpp */
+extern struct parameters serv_params;
+extern struct addrinfo * socket_info;
+extern Log logging;
 
 
 void daemon_mode();
 void print_usage(const char *);
+size_t parse_size(const char *);
 void pr_error(const char *);
-void parse_args(int, char *);
-void create_socket_open_port();
-const std::string get_time_for_logging(time_t);
-const std::string get_time_in_gmt(time_t);
+void parse_args(int, char * []);
+int create_socket_open_port();
+void pin_thread(int);
+void pin_thread(const std::vector<int> &);
+void get_time_for_logging(time_t, char *);
+size_t get_logstring(http_request *, http_response &, char *);
 const std::string get_ip(struct sockaddr_in *);
 void print_debugging_message();
 int get_method_as_int(const char *);
 const char * get_status_as_string(int);
-std::string normalize_path(char const *);
+const char * get_mime_type(extension);
+void init_header_templates();
+void normalize_path(char const *, std::string &);
 void build_response_header(http_response &);
-void scheduling_thread();
-void worker_thread(int);
-off_t get_filesize(std::string *);
+void scheduling_thread(std::vector<class WorkerPool *>, bool);
+void adapt_thread(std::vector<class WorkerPool *>);
+void run_acceptor(class Reactor *, int);
+void handle_request(http_request *);
+void report_stats();
+void init_request(http_request *, int, const RequestParser &, const char *);
+bool wants_keep_alive(const RequestParser &);
 extension get_file_extension(const char *);
 void get_file_content(http_request *, http_response &);
-bool compare_time(http_request *, http_request *);
-bool compare_size(http_request *, http_request *);
+void get_status_content(http_request *, http_response &);
+void prepare_response(http_request *, http_response &, uint64_t);
+bool send_response(int, http_response &, size_t);
+int response_buffers(http_response &, size_t, struct iovec *);
+void finish_request(http_request *, http_response &, bool);
+bool complete_request(http_request *, http_response &, bool);
+void reject_request(http_request *);
+bool wait_writable(int);
+bool send_buffer(int, const char *, size_t, int flags=0);
+bool send_buffers(int, struct iovec *, int);
+bool splice_file(int, int, off_t, size_t);
+bool send_file(int, int, off_t, size_t);
+bool send_parts(int, http_response &, size_t);
 
 
 #endif
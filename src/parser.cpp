@@ -0,0 +1,128 @@
+
+#include "parser.h"
+
+
+/* Helper method checks for a character allowed in methods and header names (RFC 7230 tchar) */
+static inline bool is_token_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+           || (c > 0x20 && c < 0x7f && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+static bool is_token(const char * str, size_t len) {
+    if (!len) return false;
+    for (size_t i=0; i<len; i++)
+        if (!is_token_char(str[i])) return false;
+    return true;
+}
+
+/* Prepares parser for the next request on the connection */
+void RequestParser::reset() {
+    state = REQUEST_LINE;
+    pos = 0;
+    header_count = 0;
+    method = target = version = str_view();
+    error_text = NULL;
+}
+
+/*
+ * Parses complete lines of buf starting where the previous call stopped. With
+ * eof set the last line may end without a newline and a head without the
+ * empty line is complete, since no more bytes will come.
+ */
+parse_result RequestParser::parse(char * buf, size_t len, bool eof) {
+    while (state == REQUEST_LINE || state == HEADERS) {
+        char * line = buf + pos;
+        char * nl = (char *) memchr(line, '\n', len - pos);
+        size_t line_len, next;
+        if (nl) {
+            line_len = nl - line;
+            next = pos + line_len + 1;
+        }
+        else if (eof && pos < len) {
+            line_len = len - pos;
+            next = len;
+        }
+        else if (eof && state == HEADERS) {
+            state = DONE;
+            break;
+        }
+        else return PARSE_INCOMPLETE;
+        if (line_len && line[line_len - 1] == '\r') line_len--;
+        /* Fields are used as C strings, a NUL inside would cut them short */
+        if (memchr(line, '\0', line_len)) {
+            fail("NUL byte in request head");
+            return PARSE_ERROR;
+        }
+        line[line_len] = '\0';
+        if (state == REQUEST_LINE) {
+            /* Empty lines in front of a request line are skipped */
+            if (line_len && !request_line(line, line_len)) return PARSE_ERROR;
+        }
+        else if (!line_len) state = DONE;
+        else if (!header_line(line, line_len)) return PARSE_ERROR;
+        pos = next;
+    }
+    return state == DONE ? PARSE_DONE : PARSE_ERROR;
+}
+
+/* Helper method splits "METHOD target HTTP/x.y", a line without version is HTTP/0.9 */
+bool RequestParser::request_line(char * line, size_t len) {
+    char * sp = (char *) memchr(line, ' ', len);
+    if (!sp) return fail("request line without target");
+    size_t method_len = sp - line;
+    if (method_len > PARSER_MAX_METHOD || !is_token(line, method_len))
+        return fail("invalid method");
+    char * uri = sp + 1;
+    size_t rest = len - method_len - 1;
+    char * sp2 = (char *) memchr(uri, ' ', rest);
+    size_t uri_len = sp2 ? (size_t) (sp2 - uri) : rest;
+    if (!uri_len || uri_len > PARSER_MAX_TARGET) return fail("invalid target length");
+    for (size_t i=0; i<uri_len; i++)
+        if ((unsigned char) uri[i] <= 0x20 || uri[i] == 0x7f) return fail("invalid target");
+    if (sp2) {
+        char * ver = sp2 + 1;
+        size_t ver_len = rest - uri_len - 1;
+        if (ver_len != 8 || strncmp(ver, "HTTP/", 5) || ver[5] < '0' || ver[5] > '9'
+            || ver[6] != '.' || ver[7] < '0' || ver[7] > '9')
+            return fail("invalid version");
+        version = str_view(ver, ver_len);
+        *sp2 = '\0';
+        state = HEADERS;
+    }
+    else state = DONE;
+    *sp = '\0';
+    method = str_view(line, method_len);
+    target = str_view(uri, uri_len);
+    return true;
+}
+
+/* Helper method splits "Name: value", dropping whitespace around the value */
+bool RequestParser::header_line(char * line, size_t len) {
+    if (line[0] == ' ' || line[0] == '\t') return fail("obsolete line folding");
+    if (header_count == PARSER_MAX_HEADERS) return fail("too many headers");
+    char * colon = (char *) memchr(line, ':', len);
+    if (!colon || !is_token(line, colon - line)) return fail("invalid header name");
+    char * value = colon + 1, * end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t')) value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    *end = '\0';
+    *colon = '\0';
+    http_header & h = headers[header_count++];
+    h.name = str_view(line, colon - line);
+    h.value = str_view(value, end - value);
+    return true;
+}
+
+/* Helper method stops parsing with the given reason, returns false for the caller to pass on */
+bool RequestParser::fail(const char * reason) {
+    state = FAILED;
+    error_text = reason;
+    return false;
+}
+
+/* Returns value of the first header with the given name, empty if there is none */
+str_view RequestParser::find(const char * name) const {
+    for (int i=0; i<header_count; i++)
+        if (headers[i].name.equals(name)) return headers[i].value;
+    return str_view();
+}
@@ -0,0 +1,66 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <cstddef>
+#include <cstring>
+#include <strings.h>
+
+/* Parser settings */
+#define PARSER_MAX_HEADERS                  64
+#define PARSER_MAX_METHOD                   16
+#define PARSER_MAX_TARGET                   1024
+
+/* Bytes inside a receive buffer, NUL-terminated by the parser so it is a C string too */
+struct str_view {
+    const char * data;
+    size_t len;
+    str_view() : data(""), len(0) {}
+    str_view(const char * d, size_t l) : data(d), len(l) {}
+    bool empty() const { return len == 0; }
+    bool equals(const char * str) const { return strlen(str) == len && !strncasecmp(data, str, len); }
+};
+
+struct http_header {
+    str_view name, value;
+};
+
+enum parse_result {
+    PARSE_INCOMPLETE,
+    PARSE_DONE,
+    PARSE_ERROR
+};
+
+/*
+ * Resumable parser of an HTTP/1.x request head. It works on the receive buffer
+ * in place: every call continues at the first line not parsed yet, finds line
+ * ends with memchr() and only looks at complete lines, so a head split across
+ * any number of reads gives the same result as one read. Fields are views into
+ * the buffer; the byte after each field is overwritten with NUL, so the buffer
+ * must stay untouched until the request is served. Request line without a
+ * version is HTTP/0.9 and has no headers.
+ */
+class RequestParser {
+public:
+    RequestParser() { reset(); }
+    void reset();
+    parse_result parse(char *, size_t, bool eof=false);
+    /* Bytes taken by the head including empty lines before it, valid after PARSE_DONE */
+    size_t head_length() const { return pos; }
+    const char * error() const { return error_text; }
+    str_view find(const char *) const;
+    bool fail(const char *);
+
+    str_view method, target, version;
+    http_header headers[PARSER_MAX_HEADERS];
+    int header_count;
+private:
+    bool request_line(char *, size_t);
+    bool header_line(char *, size_t);
+
+    enum { REQUEST_LINE, HEADERS, DONE, FAILED } state;
+    size_t pos;                                         // start of the first line not parsed yet
+    const char * error_text;
+};
+
+
+#endif
@@ -0,0 +1,36 @@
+
+#include "policy.h"
+
+
+/* Helper method returns bytes left to send, using the cached size of a file not started yet */
+int64_t SchedulingPolicy::remaining_bytes(const http_request * req) {
+    const http_response & resp = req->response;
+    if (req->prepared) return resp.header_len + resp.content_length - resp.sent;
+    return req->f_size >= 0 ? req->f_size : POLICY_UNKNOWN_SIZE;
+}
+
+int64_t FCFSPolicy::key(const http_request * req) const {
+    return req->arrival_ns;
+}
+
+int64_t SJFPolicy::key(const http_request * req) const {
+    /* size - rate * (now - arrival) orders requests the same way at any moment */
+    return remaining_bytes(req) + (int64_t) (req->arrival_ns * (double) rate / 1000000000);
+}
+
+int64_t SRPTPolicy::key(const http_request * req) const {
+    return remaining_bytes(req);
+}
+
+int64_t EDFPolicy::key(const http_request * req) const {
+    return req->arrival_ns + POLICY_EDF_SLACK_NS + (int64_t) (remaining_bytes(req) * 1000000000.0 / POLICY_EDF_RATE);
+}
+
+/* Returns policy with the given name or NULL */
+SchedulingPolicy * make_policy(const std::string & name, size_t aging_rate) {
+    if (name == "FCFS") return new FCFSPolicy();
+    if (name == "SJF") return new SJFPolicy(aging_rate);
+    if (name == "SRPT") return new SRPTPolicy();
+    if (name == "EDF") return new EDFPolicy();
+    return NULL;
+}
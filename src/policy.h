@@ -0,0 +1,80 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include "myhttpd.h"
+
+/* Scheduler settings */
+#define POLICY_UNKNOWN_SIZE                 (16 << 10)  // size assumed for a file that is not in the cache yet
+#define POLICY_SRPT_QUANTUM                 (256 << 10) // bytes sent before a request goes back into the queue
+#define POLICY_EDF_SLACK_NS                 50000000    // deadline of an empty response
+#define POLICY_EDF_RATE                     (10 << 20)  // bytes per second a deadline allows for the body
+
+/*
+ * Scheduling policy of the request queues. A policy turns a request into a
+ * key when the request enters a queue and the smallest key is served first;
+ * equal keys are served in submit order, so the queue order is a strict weak
+ * ordering. Keys must not change while a request waits, which is why aging
+ * and deadlines are expressed through the arrival time instead of the time
+ * of comparison.
+ */
+class SchedulingPolicy {
+public:
+    SchedulingPolicy(const char * n) : policy_name(n) {}
+    virtual ~SchedulingPolicy() {}
+    const char * name() const { return policy_name; }
+    virtual int64_t key(const http_request *) const = 0;
+    /* Bytes of a response sent before the request is queued again, 0 sends it at once */
+    virtual size_t quantum() const { return 0; }
+    static int64_t remaining_bytes(const http_request *);
+private:
+    const char * policy_name;
+};
+
+/* First come, first served */
+class FCFSPolicy : public SchedulingPolicy {
+public:
+    FCFSPolicy() : SchedulingPolicy("FCFS") {}
+    int64_t key(const http_request *) const;
+};
+
+/*
+ * Shortest job first with aging: every second of waiting counts as rate bytes
+ * less, so a large file gets ahead of newer small ones after size/rate seconds.
+ * Rate 0 is plain SJF.
+ */
+class SJFPolicy : public SchedulingPolicy {
+public:
+    SJFPolicy(size_t r) : SchedulingPolicy("SJF"), rate(r) {}
+    int64_t key(const http_request *) const;
+private:
+    size_t rate;
+};
+
+/* Shortest remaining bytes first, large responses are sent in quanta between shorter ones */
+class SRPTPolicy : public SchedulingPolicy {
+public:
+    SRPTPolicy() : SchedulingPolicy("SRPT") {}
+    int64_t key(const http_request *) const;
+    size_t quantum() const { return POLICY_SRPT_QUANTUM; }
+};
+
+/* Earliest deadline first, a deadline is arrival plus slack growing with the size */
+class EDFPolicy : public SchedulingPolicy {
+public:
+    EDFPolicy() : SchedulingPolicy("EDF") {}
+    int64_t key(const http_request *) const;
+};
+
+/* Orders request queue by policy key and then by submit sequence */
+struct request_order {
+    bool operator()(const http_request * r1, const http_request * r2) const {
+        return r1->key > r2->key || (r1->key == r2->key && r1->seq > r2->seq);
+    }
+};
+
+SchedulingPolicy * make_policy(const std::string &, size_t);
+
+extern SchedulingPolicy * scheduling_policy;
+
+
+#endif
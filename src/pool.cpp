@@ -0,0 +1,312 @@
+
+#include "pool.h"
+#include "stats.h"
+#include <cmath>
+
+
+WorkerPool::WorkerPool(int n, const std::vector<int> & c, int min) : threads(n), min_threads(min), cpus(c), active(min ? min : n),
+    spawned(0), last_adapt(0), last_busy(0), last_wait(0), last_picked(0), calm(0), fair(NULL), sleeping(0), next_seq(0), waiting(0),
+    first_above(0), drop_next(0), drop_count(0), dropping(false) {
+    if (serv_params.fair_prefix) fair = new FairQueue(serv_params.fair_prefix, serv_params.client_cap);
+    for (int id=0; id<threads; id++) {
+        deques.push_back(new request_deque());
+        loads.push_back(new worker_load());
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    for (size_t i=0; i<deques.size(); i++) delete deques[i];
+    for (size_t i=0; i<loads.size(); i++) delete loads[i];
+    delete fair;
+}
+
+/* Creates worker threads, the minimum of an adaptive pool. Requests queued before are served right away */
+void WorkerPool::start() {
+    last_adapt = monotonic_ns();
+    resize(active.load());
+}
+
+/*
+ * Puts request into the request queue, called by the reactor and by workers
+ * putting back a partly sent response. Key is computed once, outside the lock.
+ */
+void WorkerPool::submit(http_request * req) {
+    req->pool = this;
+    req->key = scheduling_policy->key(req);
+    /* Lock mutex */
+    std::unique_lock<std::mutex> mql(m);
+    /************* Critical section ***********/
+    req->seq = next_seq++;
+    if (fair) fair->push(req);
+    else queue.push(req);
+    /******************************************/
+    mql.unlock();
+    /* Parked workers count is updated under the same mutex, no wake-up is lost */
+    if (sleeping.load()) cv.notify_one();
+}
+
+/*
+ * Queues new request unless serv_params.queue_max of them are already waiting.
+ * With fair queuing a full queue still takes a request of a client holding
+ * less than its share, so one client can not keep the others out. Returns
+ * false if it was not queued.
+ */
+bool WorkerPool::admit(http_request * req) {
+    if (serv_params.queue_max && waiting.load(std::memory_order_relaxed) >= serv_params.queue_max) {
+        if (!fair) return false;
+        std::lock_guard<std::mutex> lg(m);
+        if (!fair->under_share(req, serv_params.queue_max)) return false;
+    }
+    waiting.fetch_add(1, std::memory_order_relaxed);
+    submit(req);
+    return true;
+}
+
+void WorkerPool::worker(int id) {
+    http_request * req;
+    /* Workers run on the node of their acceptor */
+    pin_thread(cpus);
+    while (true) {
+        if (id < active.load(std::memory_order_relaxed) && next_request(id, req)) {
+            server_stats.set_busy(true);
+            /* Request object is reused by its connection once handled, its client and times are taken before */
+            fair_client * client = req->fair;
+            bool fresh = !req->prepared;
+            uint64_t picked = min_threads ? monotonic_ns() : 0, arrival = req->arrival_ns;
+            /* Partly sent response is back for its next chunk and is never shed */
+            if (req->prepared) handle_request(req);
+            else {
+                waiting.fetch_sub(1, std::memory_order_relaxed);
+                if (overdue(req)) reject_request(req);
+                else handle_request(req);
+            }
+            if (fair) client_finished(client);
+            if (min_threads) account(id, fresh, picked - arrival, monotonic_ns() - picked);
+            server_stats.set_busy(false);
+        }
+        else park(id);
+    }
+}
+
+/* Helper method adds handling time of a request to the worker's counters, and queue wait of a new one */
+void WorkerPool::account(int id, bool fresh, uint64_t wait, uint64_t busy) {
+    worker_load * l = loads[id];
+    /* Only this worker writes its counters, adapt() reads them */
+    l->busy_ns.store(l->busy_ns.load(std::memory_order_relaxed) + busy, std::memory_order_relaxed);
+    if (!fresh) return;
+    l->wait_ns.store(l->wait_ns.load(std::memory_order_relaxed) + wait, std::memory_order_relaxed);
+    l->picked.store(l->picked.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/*
+ * Sizes an adaptive pool from what its workers did since the last call, run
+ * by the adapt thread every POOL_ADAPT_MS. Requests waiting longer than
+ * POOL_GROW_WAIT_MS on average, or busy workers with as many requests queued,
+ * grow the pool by half; a pool mostly idle with nothing queued for
+ * POOL_SHRINK_ROUNDS calls in a row gives up one worker. Changes are printed
+ * on standard error and kept for the status page, not written to the access log.
+ */
+void WorkerPool::adapt(int shard) {
+    uint64_t now = monotonic_ns(), busy = 0, wait = 0, picked = 0;
+    for (int i=0; i<threads; i++) {
+        busy += loads[i]->busy_ns.load(std::memory_order_relaxed);
+        wait += loads[i]->wait_ns.load(std::memory_order_relaxed);
+        picked += loads[i]->picked.load(std::memory_order_relaxed);
+    }
+    int n = active.load();
+    double utilization = (double) (busy - last_busy) / ((now - last_adapt) * n);
+    double wait_ms = picked > last_picked ? (double) (wait - last_wait) / (picked - last_picked) / 1e6 : 0;
+    last_adapt = now;
+    last_busy = busy;
+    last_wait = wait;
+    last_picked = picked;
+    size_t queued = depth();
+    int target = n;
+    if (wait_ms > POOL_GROW_WAIT_MS || (utilization > POOL_GROW_UTILIZATION && queued >= (size_t) n)) {
+        target = std::min(n + std::max(n / 2, 1), threads);
+        calm = 0;
+    }
+    else if (utilization < POOL_SHRINK_UTILIZATION && !queued) {
+        if (++calm >= POOL_SHRINK_ROUNDS) {
+            target = std::max(n - 1, min_threads);
+            calm = 0;
+        }
+    }
+    else calm = 0;
+    if (target == n) return;
+    resize(target);
+    utilization = std::min(utilization, 1.0);
+    time_t at = server_clock.now();
+    std::unique_lock<std::mutex> mql(m);
+    resized.resizes++;
+    resized.from = n;
+    resized.wait_ms = wait_ms;
+    resized.utilization = utilization;
+    resized.at = at;
+    mql.unlock();
+    char date[64];
+    get_time_for_logging(at, date);
+    fprintf(stderr, "[%s] pool %d: workers %d -> %d, queue wait %.1f ms, utilization %.0f%%\n",
+        date, shard, n, target, wait_ms, utilization * 100);
+}
+
+/* Fills out with the size of the pool and its last change */
+void WorkerPool::report(pool_report & out) {
+    std::lock_guard<std::mutex> lg(m);
+    out = resized;
+    out.workers = active.load();
+    out.max_workers = threads;
+}
+
+/* Helper method sets number of active workers, creating threads the pool did not have yet */
+void WorkerPool::resize(int n) {
+    std::unique_lock<std::mutex> mql(m);
+    active.store(n);
+    while (spawned.load() < n) {
+        int id = spawned.load();
+        /* Deque of the worker is searched by others once it is counted */
+        spawned.store(id + 1);
+        workers.push_back(std::thread(&WorkerPool::worker, this, id));
+    }
+    mql.unlock();
+    /* Workers above the size become spares, spares below it take requests again */
+    cv.notify_all();
+    cv_spare.notify_all();
+}
+
+/* Helper method decides whether request picked up by a worker has waited too long to be served */
+bool WorkerPool::overdue(http_request * req) {
+    if (!serv_params.queue_wait && !serv_params.codel_target) return false;
+    uint64_t now = monotonic_ns(), sojourn = now - req->arrival_ns;
+    if (serv_params.queue_wait && sojourn > (uint64_t) serv_params.queue_wait * 1000000)
+        return true;
+    return serv_params.codel_target && codel_drop(sojourn, now);
+}
+
+/*
+ * Helper method runs CoDel on the queuing delay of a request. Once delay has
+ * stayed over target for an interval, requests are shed at a rate that grows
+ * with the square root of the number shed, until delay is under target again.
+ * Shedding that restarts soon after it stopped resumes close to its last rate.
+ */
+bool WorkerPool::codel_drop(uint64_t sojourn, uint64_t now) {
+    const uint64_t target = (uint64_t) serv_params.codel_target * 1000000;
+    const uint64_t interval = (uint64_t) POOL_CODEL_INTERVAL_MS * 1000000;
+    std::lock_guard<std::mutex> lg(codel_m);
+    /****************** Critical section ****************/
+    if (sojourn < target) {
+        first_above = 0;
+        dropping = false;
+        return false;
+    }
+    if (!dropping) {
+        if (!first_above) first_above = now + interval;
+        if (now < first_above) return false;
+        dropping = true;
+        drop_count = drop_count > 2 && now < drop_next + 16 * interval ? drop_count - 2 : 1;
+        drop_next = now + interval / sqrt(drop_count);
+        return true;
+    }
+    if (now < drop_next) return false;
+    drop_count++;
+    drop_next += interval / sqrt(drop_count);
+    return true;
+    /****************************************************/
+}
+
+/* Helper method counts request of client as done, a client that was at its cap may be served again */
+void WorkerPool::client_finished(fair_client * client) {
+    std::unique_lock<std::mutex> mql(m);
+    bool eligible = fair->finished(client);
+    mql.unlock();
+    if (eligible && sleeping.load()) cv.notify_one();
+}
+
+/*
+ * Helper method looks for work: own deque first, then deques of other workers
+ * (they hold requests taken from the queue earlier), then the request queue.
+ */
+bool WorkerPool::next_request(int id, http_request *& req) {
+    if (deques[id]->steal(req)) return true;
+    int n = spawned.load(std::memory_order_acquire);
+    for (int i=1; i<n; i++)
+        if (deques[(id + i) % n]->steal(req)) return true;
+    return refill(id, req);
+}
+
+/*
+ * Helper method takes a batch of requests from the request queue under one lock.
+ * The first one is returned to the caller, the rest go into the worker's deque.
+ * A fair batch ends early when every client with requests is at its cap.
+ */
+bool WorkerPool::refill(int id, http_request *& req) {
+    http_request * batch[POOL_BATCH_MAX];
+    int n = 0;
+    std::unique_lock<std::mutex> mql(m);
+    /****************** Critical section ****************/
+    if (fair ? fair->empty() : queue.empty()) return false;
+    int size = std::min<int>(std::max<int>((fair ? fair->size() : queue.size()) / active.load(std::memory_order_relaxed), 1),
+        POOL_BATCH_MAX);
+    if (fair) n = fair->pop(batch, size);
+    else while (n < size) {
+        batch[n++] = queue.top();
+        queue.pop();
+    }
+    /****************************************************/
+    mql.unlock();
+    req = batch[0];
+    /* Deque is empty at this point and only its owner pushes, so it can not overflow */
+    for (int i=1; i<n; i++) deques[id]->push(batch[i]);
+    if (n > 1) wake_one();
+    return true;
+}
+
+/* Returns number of requests waiting in the queue and in the deques */
+size_t WorkerPool::depth() {
+    size_t n = 0;
+    for (int i=0; i<spawned.load(); i++) n += deques[i]->size();
+    std::lock_guard<std::mutex> lg(m);
+    return n + (fair ? fair->size() : queue.size());
+}
+
+/* Appends load of clients queued in this pool, nothing without fair queuing */
+void WorkerPool::client_loads(std::vector<client_load> & out) {
+    if (!fair) return;
+    std::lock_guard<std::mutex> lg(m);
+    fair->loads(out);
+}
+
+bool WorkerPool::has_local_work() {
+    for (int i=0; i<spawned.load(); i++)
+        if (!deques[i]->empty()) return true;
+    return false;
+}
+
+/*
+ * Blocks worker until there is a request in the queue or in any deque. A
+ * spare worker waits until the pool grows again, requests left in its deque
+ * are stolen by a worker it wakes.
+ */
+void WorkerPool::park(int id) {
+    std::unique_lock<std::mutex> mql(m);
+    if (id >= active.load()) {
+        if (!deques[id]->empty()) cv.notify_one();
+        cv_spare.wait(mql, [this, id](){ return id < active.load(); });
+        return;
+    }
+    sleeping++;
+    cv.wait(mql, [this, id](){
+        return id >= active.load() || !(fair ? fair->empty() : queue.empty()) || has_local_work();
+    });
+    sleeping--;
+}
+
+/* Wakes one parked worker so it can steal freshly pushed requests */
+void WorkerPool::wake_one() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load()) {
+        /* Parked worker is either before its check or inside wait() */
+        std::lock_guard<std::mutex> lg(m);
+        cv.notify_one();
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "myhttpd.h"
+#include "deque.h"
+#include "policy.h"
+#include "fair.h"
+
+/* Worker pool settings */
+#define POOL_DEQUE_SIZE                     64
+#define POOL_BATCH_MAX                      16
+#define POOL_CODEL_INTERVAL_MS              100         // delay over target for this long starts shedding
+#define POOL_ADAPT_MS                       500         // interval between pool size decisions
+#define POOL_GROW_WAIT_MS                   5           // mean queue wait that adds workers
+#define POOL_GROW_UTILIZATION               0.9         // busy share of workers that adds workers while requests wait
+#define POOL_SHRINK_UTILIZATION             0.3         // busy share under which a worker is taken away
+#define POOL_SHRINK_ROUNDS                  4           // intervals in a row calm enough to shrink
+
+/* Time counters of one worker, written by it alone and read by adapt() */
+struct worker_load {
+    std::atomic<uint64_t> busy_ns, wait_ns, picked;
+    char pad[CACHE_LINE_SIZE - 3 * sizeof(std::atomic<uint64_t>)];
+    worker_load() : busy_ns(0), wait_ns(0), picked(0) {}
+};
+
+/* Size of a pool and its last change by adapt(), for the status page */
+struct pool_report {
+    int workers = 0, max_workers = 0;
+    unsigned long resizes = 0;
+    int from = 0;                                       // workers before the last change
+    double wait_ms = 0, utilization = 0;                // seen by the last change
+    time_t at = 0;
+};
+
+/*
+ * Pool of worker threads fed from the request queue. An idle worker takes
+ * its next request from its own deque, then steals from other workers and
+ * only then refills from the request queue. Refills take a batch in the order
+ * of the scheduling policy, sized by queue length per worker, so under light
+ * load every request is ordered exactly as before and under heavy load the
+ * order is kept within a batch. Workers with nothing to do park on a
+ * condition variable. New requests are admitted up to a queue depth and shed
+ * when they waited too long, or by CoDel when the delay stays over target.
+ * With fair queuing the request queue is a FairQueue taking turns between
+ * clients instead of one queue in policy order. An adaptive pool has workers
+ * between a minimum and a maximum: every POOL_ADAPT_MS the adapt thread
+ * looks at queue wait and utilization and grows or shrinks it. Workers over
+ * the size are kept as spares waiting to be needed again, not stopped.
+ */
+class WorkerPool {
+public:
+    WorkerPool(int, const std::vector<int> & cpus=std::vector<int>(), int min=0);
+    ~WorkerPool();
+    void start();
+    void submit(http_request *);
+    bool admit(http_request *);
+    int size() const { return active.load(std::memory_order_relaxed); }
+    void adapt(int);
+    void report(pool_report &);
+    size_t depth();
+    void client_loads(std::vector<client_load> &);
+private:
+    typedef StealingDeque<http_request *, POOL_DEQUE_SIZE> request_deque;
+
+    void worker(int);
+    bool next_request(int, http_request *&);
+    bool refill(int, http_request *&);
+    bool has_local_work();
+    bool overdue(http_request *);
+    bool codel_drop(uint64_t, uint64_t);
+    void client_finished(fair_client *);
+    void park(int);
+    void wake_one();
+    void account(int, bool, uint64_t, uint64_t);
+    void resize(int);
+
+    int threads, min_threads;                           // threads is the maximum, min_threads 0 keeps it fixed
+    std::vector<int> cpus;                              // workers may run on, empty for any
+    std::atomic<int> active;                            // workers taking requests, the rest are spares
+    std::atomic<int> spawned;                           // threads created, their deques are searched
+    std::condition_variable cv_spare;
+    std::vector<worker_load *> loads;
+    /* Last counters seen by adapt(), adapt thread only */
+    uint64_t last_adapt, last_busy, last_wait, last_picked;
+    int calm;
+    pool_report resized;                                // guarded by m
+    std::vector<request_deque *> deques;
+    std::vector<std::thread> workers;
+    http_request_queue queue;
+    FairQueue * fair;                                   // replaces queue when clients are served fairly
+    std::mutex m;
+    std::condition_variable cv;
+    std::atomic<int> sleeping;
+    uint64_t next_seq;
+    std::atomic<size_t> waiting;                        // admitted requests no worker has started
+    /* CoDel state, guarded by codel_m */
+    std::mutex codel_m;
+    uint64_t first_above, drop_next;
+    unsigned drop_count;
+    bool dropping;
+};
+
+
+#endif
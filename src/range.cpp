@@ -0,0 +1,213 @@
+
+#include "range.h"
+
+
+struct byte_range {
+    off_t first, last;
+};
+
+/* Helper method appends number in hex */
+static char * append_hex(char * p, unsigned long long value) {
+    char digits[16];
+    int n = 0;
+    do digits[n++] = "0123456789abcdef"[value & 15]; while (value >>= 4);
+    while (n) *p++ = digits[--n];
+    return p;
+}
+
+/*
+ * Sets strong ETag of the file version in f_info, made of its inode, size and
+ * mtime to the nanosecond, as versions written within one second must differ.
+ * The gzip variant is another representation and gets a tag of its own.
+ */
+void set_etag(http_response & resp, const struct stat & f_info) {
+    char * p = resp.etag;
+    *p++ = '"';
+    p = append_hex(p, f_info.st_ino);
+    *p++ = '-';
+    p = append_hex(p, f_info.st_size);
+    *p++ = '-';
+    p = append_hex(p, f_info.st_mtime);
+    *p++ = '.';
+    p = append_hex(p, f_info.st_mtim.tv_nsec);
+    if (resp.gzip) {
+        memcpy(p, "-gz", 3);
+        p += 3;
+    }
+    *p++ = '"';
+    resp.etag_len = p - resp.etag;
+}
+
+/* Helper method checks whether comma-separated list of tags has the response's one, "*" matches any */
+static bool etag_listed(str_view list, const http_response & resp) {
+    const char * p = list.data, * end = list.data + list.len;
+    while (p < end) {
+        const char * comma = (const char *) memchr(p, ',', end - p);
+        if (!comma) comma = end;
+        const char * tag_end = comma;
+        while (p < tag_end && (*p == ' ' || *p == '\t')) p++;
+        while (tag_end > p && (tag_end[-1] == ' ' || tag_end[-1] == '\t')) tag_end--;
+        size_t len = tag_end - p;
+        if (len == 1 && *p == '*') return true;
+        /* Weak comparison, W/ is dropped */
+        if (len > 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+            len -= 2;
+        }
+        if (len == resp.etag_len && !memcmp(p, resp.etag, len)) return true;
+        p = comma + 1;
+    }
+    return false;
+}
+
+/*
+ * Helper method checks whether date is the response's Last-Modified or later.
+ * A date later than the server's time is invalid and ignored (RFC 9110 13.1.3).
+ */
+static bool not_modified_since(str_view date, const http_response & resp) {
+    time_t now = server_clock.now();
+    /* Client usually sends back the value it got, which needs no parsing */
+    if (resp.last_modified && date.len == HTTP_DATE_LENGTH && !memcmp(date.data, resp.last_modified, date.len))
+        return resp.mod_time <= now;
+    time_t since = parse_http_date(date.data);
+    return since != -1 && since <= now && resp.mod_time <= since;
+}
+
+/* Helper method checks If-Range value, an entity tag or a date, for an exact match */
+static bool if_range_matches(str_view value, const http_response & resp) {
+    if (value.data[0] == '"')
+        return value.len == resp.etag_len && !memcmp(value.data, resp.etag, value.len);
+    return parse_http_date(value.data) == resp.mod_time;
+}
+
+/* Helper method reads decimal number, returns false if there is none or it is too long */
+static bool parse_offset(const char * & p, const char * end, off_t & out) {
+    const char * start = p;
+    out = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (p - start == 18) return false;
+        out = out * 10 + (*p++ - '0');
+    }
+    return p > start;
+}
+
+/*
+ * Helper method parses "bytes=" ranges of a body of size bytes into out. Returns
+ * number of satisfiable ranges, 0 if the header is to be ignored (bad syntax or
+ * too many ranges), or -1 if no range is satisfiable.
+ */
+static int parse_ranges(str_view header, off_t size, byte_range * out) {
+    if (header.len < 6 || strncasecmp(header.data, "bytes=", 6)) return 0;
+    const char * p = header.data + 6, * end = header.data + header.len;
+    int count = 0, specs = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) break;
+        byte_range r;
+        if (++specs > RANGE_MAX_COUNT) return 0;
+        /* "-n" asks for the last n bytes */
+        if (*p == '-') {
+            off_t suffix;
+            if (!parse_offset(++p, end, suffix)) return 0;
+            r.first = suffix < size ? size - suffix : 0;
+            r.last = suffix ? size - 1 : -1;
+        }
+        else {
+            if (!parse_offset(p, end, r.first) || p == end || *p++ != '-') return 0;
+            r.last = size - 1;
+            if (p < end && *p >= '0' && *p <= '9') {
+                off_t last;
+                if (!parse_offset(p, end, last) || last < r.first) return 0;
+                r.last = std::min(last, size - 1);
+            }
+        }
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p < end && *p != ',') return 0;
+        if (r.first <= r.last && r.first < size) out[count++] = r;
+    }
+    if (!specs) return 0;
+    return count ? count : -1;
+}
+
+/* Helper method appends piece of a multipart body */
+static void add_part(http_response & resp, bool text, off_t offset, size_t len) {
+    body_part part;
+    part.text = text;
+    part.offset = offset;
+    part.len = len;
+    resp.parts.push_back(part);
+    resp.content_length += len;
+}
+
+/*
+ * Helper method turns body into multipart/byteranges. Part headers are written
+ * into text, the request's scratch, the ranges stay in the file or cached data
+ * and are sent from there.
+ */
+static void make_multipart(http_response & resp, std::string & text, byte_range * ranges, int count, off_t size) {
+    const char * mime = get_mime_type(resp.content_type);
+    resp.content_length = 0;
+    for (int i=0; i<count; i++) {
+        char part[256];
+        int len = snprintf(part, sizeof(part), "\r\n--%s\r\n%s%s%sContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                           RANGE_BOUNDARY, mime ? "Content-Type: " : "", mime ? mime : "", mime ? "\r\n" : "",
+                           (long long) ranges[i].first, (long long) ranges[i].last, (long long) size);
+        add_part(resp, true, text.size(), len);
+        text.append(part, len);
+        add_part(resp, false, ranges[i].first, ranges[i].last - ranges[i].first + 1);
+    }
+    add_part(resp, true, text.size(), strlen("\r\n--" RANGE_BOUNDARY "--\r\n"));
+    text += "\r\n--" RANGE_BOUNDARY "--\r\n";
+    resp.part_text = text.data();
+    /* Each part names its own type, the response is multipart */
+    resp.content_type = UNKNOWN;
+}
+
+/* Helper method drops body of the response, cached entry stays as it holds Last-Modified */
+static void drop_body(http_response & resp) {
+    if (resp.file_fd != -1) close(resp.file_fd);
+    resp.file_fd = -1;
+    resp.content_length = 0;
+}
+
+/*
+ * Evaluates conditional and range headers of a request for a file answered with
+ * 200. If-None-Match, or If-Modified-Since without it, turns the response into
+ * 304 without body. Range of a GET, unless If-Range shows the client has another
+ * version, turns it into 206 with one range or multipart/byteranges with
+ * several, or into 416 if no range is satisfiable.
+ */
+void check_conditions(http_request * req, http_response & resp) {
+    if (!req->parsed || resp.req_status != HTTP_STATUS_CODE_OK || !resp.etag_len) return;
+    str_view none_match = req->parsed->find("If-None-Match");
+    str_view since = req->parsed->find("If-Modified-Since");
+    if (none_match.empty() ? !since.empty() && not_modified_since(since, resp) : etag_listed(none_match, resp)) {
+        drop_body(resp);
+        resp.req_status = HTTP_STATUS_CODE_NOT_MODIFIED;
+        return;
+    }
+    str_view range = req->parsed->find("Range");
+    if (range.empty() || resp.head) return;
+    str_view if_range = req->parsed->find("If-Range");
+    if (!if_range.empty() && !if_range_matches(if_range, resp)) return;
+    byte_range ranges[RANGE_MAX_COUNT];
+    off_t size = resp.content_length;
+    int count = parse_ranges(range, size, ranges);
+    if (!count) return;
+    if (count < 0) {
+        drop_body(resp);
+        resp.content_type = UNKNOWN;
+        resp.content_range_len = snprintf(resp.content_range, CONTENT_RANGE_LENGTH, "bytes */%lld", (long long) size);
+        resp.req_status = HTTP_STATUS_CODE_RANGE;
+        return;
+    }
+    resp.req_status = HTTP_STATUS_CODE_PARTIAL;
+    if (count > 1) {
+        make_multipart(resp, req->scratch, ranges, count, size);
+        return;
+    }
+    resp.body_offset = ranges[0].first;
+    resp.content_length = ranges[0].last - ranges[0].first + 1;
+    resp.content_range_len = snprintf(resp.content_range, CONTENT_RANGE_LENGTH, "bytes %lld-%lld/%lld",
+                                      (long long) ranges[0].first, (long long) ranges[0].last, (long long) size);
+}
@@ -0,0 +1,15 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#include "myhttpd.h"
+
+/* Range settings */
+#define RANGE_MAX_COUNT                     16              // request with more ranges gets the whole body
+#define RANGE_BOUNDARY                      "myhttpd-7c3f09a1e6b25d48"
+#define RANGE_MULTIPART_TYPE                "multipart/byteranges; boundary=" RANGE_BOUNDARY
+
+void set_etag(http_response &, const struct stat &);
+void check_conditions(http_request *, http_response &);
+
+
+#endif
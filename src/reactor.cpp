@@ -0,0 +1,567 @@
+
+#include "reactor.h"
+#include "stats.h"
+
+
+Reactor::Reactor(int fd, WorkerPool * p) : listen_fd(fd), pool(p), ticking(false),
+    accept_paused(false), free_list(NULL), free_count(0), open_count(0), released(NULL), stopping(false),
+    ring_mode(false), fixed_files(false), accept_flags(IORING_ACCEPT_MULTISHOT),
+    poll_flags(IORING_POLL_ADD_MULTI) {
+    struct epoll_event ev;
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        pr_error("cannot create epoll instance");
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        pr_error("cannot create eventfd");
+    /* Signals blocked by main() are delivered here */
+    sigset_t mask;
+    pthread_sigmask(SIG_BLOCK, NULL, &mask);
+    if ((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+        pr_error("cannot create signalfd");
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+        pr_error("cannot create timerfd");
+    /*
+     * Listening socket is registered with an empty data pointer, eventfd with
+     * the reactor itself, signalfd and timerfd with their descriptor fields
+     */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1)
+        pr_error("cannot watch listening socket");
+    ev.data.ptr = this;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == -1)
+        pr_error("cannot watch eventfd");
+    ev.data.ptr = &signal_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) == -1)
+        pr_error("cannot watch signalfd");
+    ev.data.ptr = &timer_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) == -1)
+        pr_error("cannot watch timerfd");
+}
+
+Reactor::~Reactor() {
+    while (free_list) {
+        connection * con = free_list;
+        free_list = con->next_released;
+        delete con;
+    }
+    close(timer_fd);
+    close(signal_fd);
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+/* Waits for events and hands them to accept or read handlers */
+void Reactor::run() {
+    /* Ring is set up by the thread that submits to it */
+    if (serv_params.io_uring) {
+        if (ring.setup(URING_ENTRIES, URING_CQ_ENTRIES)) {
+            run_ring();
+            return;
+        }
+        perror("io_uring unavailable, using epoll");
+    }
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    while (true) {
+        bool wake = false, expired = false;
+        int n = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            pr_error("epoll_wait failed");
+        }
+        for (int i=0; i<n; i++) {
+            void * ptr = events[i].data.ptr;
+            if (ptr == NULL) accept_connections();
+            else if (ptr == this) wake = true;
+            else if (ptr == &signal_fd) handle_signals();
+            else if (ptr == &timer_fd) expired = true;
+            else {
+                connection * con = (connection *) ptr;
+                if (!(events[i].events & EPOLLERR)) read_request(con);
+                /* Connection in use by a worker is closed once it is released */
+                else if (con->busy) con->peer_closed = true;
+                else drop(con);
+            }
+        }
+        /*
+         * Released connections and expired ones may be closed here, so it is done
+         * after all events of this round that could point to them are handled
+         */
+        if (wake) resume_released();
+        if (expired) expire_deadlines();
+        if (wake && stopping.load() && listen_fd != -1) stop_accepting();
+        if (listen_fd == -1 && !open_count) return;
+    }
+}
+
+/* Accepts every pending connection, the listening socket is edge-triggered */
+void Reactor::accept_connections() {
+    while (true) {
+        struct sockaddr_in con_info;
+        socklen_t con_socklen = sizeof(con_info);
+        int con_fd = accept4(listen_fd, (struct sockaddr *) &con_info, &con_socklen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (con_fd == -1) {
+            /* Connection aborted before it was accepted, keep draining */
+            if (errno == ECONNABORTED || errno == EINTR) continue;
+            /*
+             * EAGAIN means the backlog is empty. EMFILE and alike are retried on
+             * next tick, edge-triggered socket gives no event for connections
+             * already waiting
+             */
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                accept_paused = true;
+                if (!ticking) tick(true);
+            }
+            return;
+        }
+        connection * con = open_connection(con_fd, con_info);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = con;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, con_fd, &ev) == -1) {
+            drop(con);
+            continue;
+        }
+        /* Client may have sent its request together with the handshake */
+        read_request(con);
+    }
+}
+
+/* Sets up connection accepted on con_fd from addr */
+connection * Reactor::open_connection(int con_fd, const struct sockaddr_in & addr) {
+    connection * con = take_connection();
+    con->fd = con_fd;
+    con->addr = addr;
+    inet_ntop(AF_INET, &addr.sin_addr, con->rem_ip, sizeof(con->rem_ip));
+    con->owner = this;
+    open_count++;
+    set_deadline(con, serv_params.header_timeout);
+    return con;
+}
+
+/*
+ * Reads available bytes until EAGAIN and dispatches a complete request head.
+ * While connection is busy, bytes of pipelined requests are only buffered.
+ */
+void Reactor::read_request(connection * con) {
+    while (true) {
+        if (!con->busy && parse_buffered(con)) return;
+        if (con->busy && con->len == CON_BUFFER_LENGTH) return;
+        ssize_t got = recv(con->fd, con->buf + con->len, CON_BUFFER_LENGTH - con->len, 0);
+        if (got > 0) {
+            received(con, got);
+            continue;
+        }
+        if (got == -1 && errno == EINTR) continue;
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        /* Peer closed connection or error occurred */
+        peer_gone(con);
+        return;
+    }
+}
+
+/* Parses buffered bytes and dispatches the request head if it is complete. Returns false if more bytes are needed */
+bool Reactor::parse_buffered(connection * con) {
+    uint64_t start = monotonic_ns();
+    parse_result result = con->parser.parse(con->buf, con->len);
+    if (result != PARSE_INCOMPLETE) {
+        dispatch(con, result == PARSE_DONE, start);
+        return true;
+    }
+    /* Request head does not fit into the buffer */
+    if (con->len == CON_BUFFER_LENGTH) {
+        con->parser.fail("request head too large");
+        dispatch(con, false, start);
+        return true;
+    }
+    return false;
+}
+
+/* Accounts for got bytes received into the buffer */
+void Reactor::received(connection * con, size_t got) {
+    con->len += got;
+    con->buf[con->len] = '\0';
+    /* Next request has begun, its head must arrive within the header timeout */
+    if (con->idle) {
+        con->idle = false;
+        set_deadline(con, serv_params.header_timeout);
+    }
+}
+
+/* Handles end of input, whatever was received is served, e.g. request line without an empty line after it */
+void Reactor::peer_gone(connection * con) {
+    con->peer_closed = true;
+    if (con->busy) return;
+    uint64_t start = monotonic_ns();
+    parse_result result = con->parser.parse(con->buf, con->len, true);
+    if (result != PARSE_INCOMPLETE) dispatch(con, result == PARSE_DONE, start);
+    else drop(con);
+}
+
+/*
+ * Hands request parsed at the start of the buffer over to the worker pool. The
+ * request points into the buffer, so its head stays in place until the request
+ * is served; bytes after it belong to the next pipelined request.
+ */
+void Reactor::dispatch(connection * con, bool valid, uint64_t start) {
+    struct http_request * request = &con->request;
+    init_request(request, con->fd, con->parser, con->rem_ip);
+    server_stats.record(STAGE_PARSE, monotonic_ns() - start);
+    request->con = con;
+    request->client_addr = ntohl(con->addr.sin_addr.s_addr);
+    request->malformed = !valid;
+    con->requests++;
+    request->keep_alive = request->keep_alive && valid && !con->peer_closed && listen_fd != -1
+                          && serv_params.keepalive_timeout > 0 && con->requests < serv_params.keepalive_max;
+    /* Rest of a rejected head can not be told apart from the next request */
+    con->head = valid ? con->parser.head_length() : con->len;
+    con->busy = true;
+    con->idle = false;
+    wheel.cancel(&con->timer);
+    if (!pool->admit(request)) reject_request(request);
+}
+
+/* Hands connection back to the reactor after response is sent, called by workers */
+void Reactor::release(connection * con, bool keep_alive) {
+    con->keep_alive = keep_alive;
+    connection * head = released.load(std::memory_order_relaxed);
+    do con->next_released = head;
+    while (!released.compare_exchange_weak(head, con, std::memory_order_release,
+                                           std::memory_order_relaxed));
+    /* Reactor takes the whole stack at once, so only the first release wakes it */
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) == -1) {}
+    }
+}
+
+/*
+ * Hands connection back with its response built but not sent, called by
+ * workers. A reactor on a ring sends a response held in memory with the
+ * receives of its next round, so the worker makes no system call for it and
+ * the wake-up it needs anyway carries the send. Returns false if the worker
+ * has to send it.
+ */
+bool Reactor::send_later(connection * con) {
+    http_response & resp = con->request.response;
+    if (!ring_mode || !resp.parts.empty() || resp.file_fd != -1) return false;
+    con->sending = true;
+    release(con, resp.keep_alive);
+    return true;
+}
+
+/* Asks reactor to stop accepting and drain, called once its listening socket is handed over */
+void Reactor::stop() {
+    stopping.store(true);
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {}
+}
+
+/* Closes released connections or waits for their next request */
+void Reactor::resume_released() {
+    uint64_t count;
+    /* Counter is reset before the stack is taken, so no release is missed */
+    if (read(wake_fd, &count, sizeof(count)) == -1) {}
+    connection * con = released.exchange(NULL, std::memory_order_acquire);
+    while (con) {
+        connection * next = con->next_released;
+        if (con->sending) ring_send(con);
+        else resume(con);
+        con = next;
+    }
+}
+
+/* Helper method closes connection whose request is served or waits for its next request */
+void Reactor::resume(connection * con) {
+    con->busy = false;
+    /* Once draining, a connection is only kept for a request already in its buffer */
+    if (!con->keep_alive || (listen_fd == -1 && con->len == con->head)) {
+        drop(con);
+        return;
+    }
+    /* Served head is no longer referenced, next request moves to the front */
+    con->len -= con->head;
+    memmove(con->buf, con->buf + con->head, con->len + 1);
+    con->head = 0;
+    con->parser.reset();
+    /* Bytes of the next request already count against the header timeout */
+    con->idle = !con->len;
+    set_deadline(con, con->idle ? serv_params.keepalive_timeout : serv_params.header_timeout);
+    /* Next request may already be in the buffer or in the socket */
+    if (!ring_mode) read_request(con);
+    else if (!parse_buffered(con)) ring_receive(con);
+}
+
+/* Reads pending signals, SIGUSR1 asks for server counters */
+void Reactor::handle_signals() {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+        if (info.ssi_signo == SIGUSR1) report_stats();
+}
+
+/* Returns connection from the free list or a new one, with the state of a new connection */
+connection * Reactor::take_connection() {
+    connection * con = free_list;
+    if (!con) return new connection();
+    free_list = con->next_released;
+    free_count--;
+    con->len = con->head = 0;
+    con->requests = 0;
+    con->busy = con->peer_closed = con->keep_alive = con->idle = con->closing = con->sending = false;
+    con->next_released = NULL;
+    con->parser.reset();
+    return con;
+}
+
+/* Closes connection, it must not be in use by a worker. Its memory is kept for the next one */
+void Reactor::drop(connection * con) {
+    wheel.cancel(&con->timer);
+    close(con->fd);
+    open_count--;
+    if (free_count == REACTOR_FREE_CONNECTIONS) {
+        delete con;
+        return;
+    }
+    con->next_released = free_list;
+    free_list = con;
+    free_count++;
+}
+
+/* Sets deadline of connection seconds from now, 0 means none */
+void Reactor::set_deadline(connection * con, int seconds) {
+    if (seconds <= 0) {
+        wheel.cancel(&con->timer);
+        return;
+    }
+    /* Wheel stands still while it is empty and catches up at once */
+    if (wheel.empty()) wheel.start(monotonic_ns() / (WHEEL_TICK_MS * 1000000ULL));
+    con->timer.data = con;
+    wheel.set(&con->timer, (uint64_t) seconds * 1000 / WHEEL_TICK_MS);
+    if (!ticking) tick(true);
+}
+
+/*
+ * Moves the wheel to the current tick and closes connections whose deadline
+ * passed. Ticking stops once no deadline is left.
+ */
+void Reactor::expire_deadlines() {
+    uint64_t count;
+    if (read(timer_fd, &count, sizeof(count)) == -1) {}
+    wheel_timer * t = wheel.advance(monotonic_ns() / (WHEEL_TICK_MS * 1000000ULL));
+    while (t) {
+        wheel_timer * next = t->next;
+        close_expired((connection *) t->data);
+        t = next;
+    }
+    if (accept_paused && listen_fd != -1) {
+        if (ring_mode) ring_accept();
+        else {
+            accept_paused = false;
+            accept_connections();
+        }
+    }
+    if (wheel.empty() && !accept_paused) tick(false);
+}
+
+/* Helper method closes connection that missed its deadline, it is never busy */
+void Reactor::close_expired(connection * con) {
+    if (!ring_mode) {
+        drop(con);
+        return;
+    }
+    /* Receive of the connection is in the ring, shutdown completes it and it is dropped then */
+    con->closing = true;
+    shutdown(con->fd, SHUT_RDWR);
+}
+
+/*
+ * Helper method closes listening socket once it is handed over, connections
+ * waiting in its queue are left to the new server. Connections waiting for
+ * their next request are closed, a request being read keeps its deadline and
+ * is answered with Connection: close.
+ */
+void Reactor::stop_accepting() {
+    if (ring_mode) {
+        struct io_uring_sqe * sqe = ring_sqe(IORING_OP_ASYNC_CANCEL, -1, RING_CANCEL);
+        sqe->addr = RING_ACCEPT;
+    }
+    else epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    accept_paused = false;
+    wheel_timer * t = wheel.take_all();
+    while (t) {
+        wheel_timer * next = t->next;
+        connection * con = (connection *) t->data;
+        if (con->idle) close_expired(con);
+        else wheel.set(t, t->expires - wheel.current());
+        t = next;
+    }
+}
+
+/* Helper method starts or stops the timerfd, it only ticks while there are deadlines */
+void Reactor::tick(bool on) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (on) {
+        spec.it_interval.tv_nsec = WHEEL_TICK_MS * 1000000L;
+        spec.it_value = spec.it_interval;
+    }
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) == -1)
+        pr_error("cannot set timerfd");
+    ticking = on;
+}
+
+/*
+ * Event loop on io_uring, taken instead of epoll with -u. One multishot accept
+ * takes every connection, and a connection waiting for request bytes has a
+ * receive in the ring; eventfd and signalfd are polled through it. Responses
+ * held in memory are sent by the ring as well. A round of events costs one
+ * system call, which also submits the receives and sends queued while
+ * handling the previous round.
+ */
+void Reactor::run_ring() {
+    ring_mode = true;
+    int fds[] = {listen_fd, wake_fd, signal_fd, timer_fd};
+    fixed_files = ring.register_files(fds, 4);
+    ring_accept();
+    ring_poll(wake_fd, 1, RING_WAKE);
+    ring_poll(signal_fd, 2, RING_SIGNAL);
+    ring_poll(timer_fd, 3, RING_TIMER);
+    while (true) {
+        if (ring.submit(1) == -1 && errno != EINTR && errno != EBUSY)
+            pr_error("io_uring_enter failed");
+        bool wake = false, expired = false;
+        while (struct io_uring_cqe * cqe = ring.completion()) {
+            uint64_t tag = cqe->user_data;
+            int res = cqe->res;
+            bool more = cqe->flags & IORING_CQE_F_MORE;
+            ring.seen();
+            if (tag == RING_ACCEPT) ring_accepted(res, more);
+            else if (tag == RING_CANCEL) continue;
+            else if (tag == RING_WAKE || tag == RING_SIGNAL || tag == RING_TIMER) {
+                /* Kernel without multishot poll rejects the flag */
+                if (res == -EINVAL && poll_flags) poll_flags = 0;
+                else if (tag == RING_WAKE) wake = true;
+                else if (tag == RING_TIMER) expired = true;
+                else handle_signals();
+                if (!more) {
+                    if (tag == RING_WAKE) ring_poll(wake_fd, 1, RING_WAKE);
+                    else if (tag == RING_TIMER) ring_poll(timer_fd, 3, RING_TIMER);
+                    else ring_poll(signal_fd, 2, RING_SIGNAL);
+                }
+            }
+            /* Busy connection has no receive in the ring, only its send */
+            else if (((connection *) tag)->sending) ring_sent((connection *) tag, res);
+            else ring_received((connection *) tag, res);
+        }
+        /* As with epoll, connections are closed after every completion of the round is handled */
+        if (wake) resume_released();
+        if (expired) expire_deadlines();
+        if (wake && stopping.load() && listen_fd != -1) stop_accepting();
+        if (listen_fd == -1 && !open_count) return;
+    }
+}
+
+/* Helper method queues submission of opcode for descriptor fd, or its registered index */
+struct io_uring_sqe * Reactor::ring_sqe(int opcode, int fd, uint64_t tag) {
+    struct io_uring_sqe * sqe = ring.get_sqe();
+    if (!sqe) pr_error("cannot submit to io_uring");
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = tag;
+    return sqe;
+}
+
+/* Helper method queues accept on the listening socket, one submission serves many connections if the kernel can */
+void Reactor::ring_accept() {
+    struct io_uring_sqe * sqe = ring_sqe(IORING_OP_ACCEPT, fixed_files ? 0 : listen_fd, RING_ACCEPT);
+    if (fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = accept_flags;
+    accept_paused = false;
+}
+
+/* Helper method queues poll for input on fd, registered as index */
+void Reactor::ring_poll(int fd, int index, uint64_t tag) {
+    struct io_uring_sqe * sqe = ring_sqe(IORING_OP_POLL_ADD, fixed_files ? index : fd, tag);
+    if (fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->poll32_events = POLLIN;
+    sqe->len = poll_flags;
+}
+
+/* Helper method queues receive into the free part of the connection buffer */
+void Reactor::ring_receive(connection * con) {
+    struct io_uring_sqe * sqe = ring_sqe(IORING_OP_RECV, con->fd, (uint64_t) con);
+    sqe->addr = (uint64_t) (con->buf + con->len);
+    sqe->len = CON_BUFFER_LENGTH - con->len;
+}
+
+/* Handles accepted connection or accept error, more tells whether the accept is still in the ring */
+void Reactor::ring_accepted(int res, bool more) {
+    if (res >= 0) {
+        /* Multishot accept has nowhere to put the address of every peer */
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        if (getpeername(res, (struct sockaddr *) &addr, &len)) memset(&addr, 0, sizeof(addr));
+        ring_receive(open_connection(res, addr));
+    }
+    else if (res == -EINVAL && accept_flags) accept_flags = 0;
+    /* EMFILE and alike are retried on next tick instead of failing in a loop */
+    else if (res != -ECONNABORTED && res != -EINTR) {
+        if (!more && listen_fd != -1) {
+            accept_paused = true;
+            if (!ticking) tick(true);
+        }
+        return;
+    }
+    if (!more && listen_fd != -1) ring_accept();
+}
+
+/* Handles completed receive of a connection */
+void Reactor::ring_received(connection * con, int res) {
+    if (con->closing) drop(con);
+    else if (res > 0) {
+        received(con, res);
+        if (!parse_buffered(con)) ring_receive(con);
+    }
+    else if (res == -EINTR || res == -EAGAIN) ring_receive(con);
+    else peer_gone(con);
+}
+
+/* Helper method queues send of the unsent part of the connection's response */
+void Reactor::ring_send(connection * con) {
+    http_response & resp = con->request.response;
+    memset(&con->msg, 0, sizeof(con->msg));
+    con->msg.msg_iov = con->iov;
+    con->msg.msg_iovlen = response_buffers(resp, resp.header_len + resp.content_length, con->iov);
+    struct io_uring_sqe * sqe = ring_sqe(IORING_OP_SENDMSG, con->fd, (uint64_t) con);
+    sqe->addr = (uint64_t) &con->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    con->send_start = monotonic_ns();
+}
+
+/*
+ * Handles completed send of a connection, a short one is continued. Once the
+ * response is out the request is recorded and logged here, as a worker does
+ * after its own send, and the connection waits for its next request.
+ */
+void Reactor::ring_sent(connection * con, int res) {
+    http_request * req = &con->request;
+    http_response & resp = req->response;
+    resp.send_ns += monotonic_ns() - con->send_start;
+    if (res == -EINTR || res == -EAGAIN) {
+        ring_send(con);
+        return;
+    }
+    if (res > 0) resp.sent += res;
+    if (res > 0 && resp.sent < resp.header_len + resp.content_length) {
+        ring_send(con);
+        return;
+    }
+    con->sending = false;
+    con->keep_alive = complete_request(req, resp, res > 0);
+    resume(con);
+}
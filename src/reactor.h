@@ -0,0 +1,121 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "myhttpd.h"
+#include "pool.h"
+#include "uring.h"
+#include "wheel.h"
+#include <sys/epoll.h>  // epoll event loop
+#include <sys/eventfd.h> // wake-ups from worker threads
+#include <sys/signalfd.h> // signals as events
+#include <sys/timerfd.h> // ticks of the timing wheel
+#include <cerrno>
+
+/* Reactor settings */
+#define REACTOR_MAX_EVENTS                  64
+#define REACTOR_FREE_CONNECTIONS            1024        // closed connections kept for reuse
+
+/* Tags of ring submissions, a receive is tagged with its connection */
+#define RING_ACCEPT                         1
+#define RING_WAKE                           2
+#define RING_SIGNAL                         3
+#define RING_TIMER                          4
+#define RING_CANCEL                         5
+
+class Reactor;
+
+/*
+ * State of a client connection. Owned by the reactor thread; while one of its
+ * requests is served (busy) a worker only writes to fd and then hands the
+ * connection back through Reactor::release(), or hands it back unsent to a
+ * reactor on a ring with Reactor::send_later(). The request object is reused
+ * for every request of the connection, and closed connections are kept by
+ * the reactor for new ones.
+ */
+struct connection {
+    int fd;
+    size_t len = 0, head = 0;                           // head: bytes of the request being served
+    unsigned int requests = 0;
+    bool busy = false, peer_closed = false, keep_alive = false, idle = false;
+    bool closing = false;                               // shut down, dropped when its receive completes
+    bool sending = false;                               // response is sent by the ring, not a receive
+    struct iovec iov[2];                                // unsent response, read by the kernel during a send
+    struct msghdr msg;
+    uint64_t send_start;
+    wheel_timer timer;                                  // deadline of the head being read or of the idle wait
+    char buf[CON_BUFFER_LENGTH + 1];
+    RequestParser parser;
+    struct http_request request;
+    struct sockaddr_in addr;
+    char rem_ip[INET_ADDRSTRLEN];
+    Reactor * owner;
+    connection * next_released = NULL;                  // stack of released connections, or free list
+};
+
+/*
+ * Edge-triggered epoll event loop. Accepts connections in batches with
+ * accept4(), reads request bytes as they arrive on non-blocking sockets and
+ * queues a request only once its head is complete. Connections waiting for
+ * their next request stay here and never occupy a worker. Requests pipelined
+ * on one connection are queued one at a time, so they are answered in order.
+ * With -u the same is done on an io_uring instead, if the kernel has one, and
+ * responses held in memory are sent through it too.
+ * Deadlines of connections are kept in a timing wheel ticked by a timerfd:
+ * a request head must be complete within the header timeout of its first
+ * byte, and a keep-alive connection is closed after the keep-alive timeout
+ * without a new request. After the listening socket is handed over to a new
+ * server, stop() makes the loop close it, serve the requests it has begun and
+ * return once no connection is left.
+ */
+class Reactor {
+public:
+    Reactor(int, WorkerPool *);
+    ~Reactor();
+    void run();
+    void release(connection *, bool);
+    bool send_later(connection *);
+    void stop();
+private:
+    void accept_connections();
+    connection * open_connection(int, const struct sockaddr_in &);
+    void read_request(connection *);
+    bool parse_buffered(connection *);
+    void received(connection *, size_t);
+    void peer_gone(connection *);
+    void dispatch(connection *, bool, uint64_t);
+    void resume_released();
+    void resume(connection *);
+    void handle_signals();
+    connection * take_connection();
+    void drop(connection *);
+    void set_deadline(connection *, int);
+    void expire_deadlines();
+    void close_expired(connection *);
+    void tick(bool);
+    void stop_accepting();
+    void run_ring();
+    struct io_uring_sqe * ring_sqe(int, int, uint64_t);
+    void ring_accept();
+    void ring_poll(int, int, uint64_t);
+    void ring_receive(connection *);
+    void ring_accepted(int, bool);
+    void ring_received(connection *, int);
+    void ring_send(connection *);
+    void ring_sent(connection *, int);
+    int listen_fd, epoll_fd, wake_fd, signal_fd, timer_fd;
+    WorkerPool * pool;
+    TimerWheel wheel;                                   // reactor only
+    bool ticking, accept_paused;                       // accept waits for a tick after EMFILE and alike
+    connection * free_list;                             // reactor only
+    size_t free_count;
+    size_t open_count;                                  // reactor only
+    std::atomic<connection *> released;
+    std::atomic<bool> stopping;
+    /* io_uring engine, reactor only */
+    Ring ring;
+    bool ring_mode, fixed_files;
+    unsigned accept_flags, poll_flags;
+};
+
+
+#endif
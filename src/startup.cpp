@@ -0,0 +1,182 @@
+
+#include "startup.h"
+#include "reactor.h"
+#include <unordered_map>
+
+
+/*
+ * Reads the files most requested in a log written by the server, or listed in
+ * a manifest with one path per line, into the file cache and the gzip cache.
+ * The hottest are read last, so if they do not all fit the LRU keeps them
+ * rather than colder ones.
+ */
+void warm_cache(const std::string & file) {
+    std::ifstream in(file.c_str());
+    if (!in) {
+        perror("cannot open warm-up file");
+        return;
+    }
+    std::unordered_map<std::string, unsigned long> counts;
+    std::vector<std::string> order;                     // first appearance, ranks paths of a manifest
+    std::string line;
+    while (std::getline(in, line)) {
+        std::string page;
+        size_t quote = line.find('"');
+        /* Log line has the request line in quotes and the status after it, only found files are taken */
+        if (quote != std::string::npos) {
+            size_t end = line.find('"', quote + 1);
+            if (end == std::string::npos) continue;
+            std::istringstream request(line.substr(quote + 1, end - quote - 1)), rest(line.substr(end + 1));
+            std::string method;
+            int status = 0;
+            request >> method >> page;
+            rest >> status;
+            if ((method != HTTP_REQUEST_GET_S && method != HTTP_REQUEST_HEAD_S)
+                || (status != HTTP_STATUS_CODE_OK && status != HTTP_STATUS_CODE_PARTIAL
+                    && status != HTTP_STATUS_CODE_NOT_MODIFIED))
+                continue;
+        }
+        else std::istringstream(line) >> page;
+        if (page.empty() || page[0] != '/') continue;
+        if (!counts[page]++) order.push_back(page);
+    }
+    std::stable_sort(order.begin(), order.end(), [&counts](const std::string & a, const std::string & b) {
+        return counts[a] > counts[b];
+    });
+    if (order.size() > STARTUP_WARM_FILES) order.resize(STARTUP_WARM_FILES);
+    /* Every file is looked up as a GET that accepts gzip, as a client would ask for it */
+    char buf[CON_BUFFER_LENGTH + 1];
+    RequestParser parser;
+    http_request req;
+    for (size_t i=order.size(); i-- > 0; ) {
+        int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n", order[i].c_str());
+        if (len < 0 || len >= CON_BUFFER_LENGTH) continue;
+        parser.reset();
+        if (parser.parse(buf, len) != PARSE_DONE) continue;
+        init_request(&req, -1, parser, "");
+        http_response & resp = req.response;
+        get_file_content(&req, resp);
+        if (resp.file_fd != -1) close(resp.file_fd);
+        delete [] resp.content;
+        resp.cached.reset();
+    }
+}
+
+/* Connects to the server listening on path for a handover, returns -1 if there is none */
+int connect_handover(const std::string & path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        pr_error("bad handover path");
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) pr_error("cannot create handover socket");
+    /* Sockets are only taken from a server of the same user */
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 || cred.uid != geteuid()) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Tells the old server this one is ready and returns the listening sockets it sends, empty if it sent none */
+std::vector<int> take_listeners(int fd) {
+    std::vector<int> fds;
+    char byte = 'R';
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * STARTUP_MAX_LISTENERS)];
+    } control;
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t got = -1;
+    if (write(fd, &byte, 1) == 1)
+        while ((got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {}
+    if (got == 1) {
+        for (struct cmsghdr * c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+            size_t n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int * received = (int *) CMSG_DATA(c);
+            fds.insert(fds.end(), received, received + n);
+        }
+    }
+    close(fd);
+    return fds;
+}
+
+/* Listens on path for the next server, replacing the socket the running one was found through */
+int listen_handover(const std::string & path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), std::min(path.size(), sizeof(addr.sun_path) - 1));
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(addr.sun_path);
+    if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 1) == -1)
+        pr_error("cannot listen for handover");
+    /* Daemon runs with umask 0, only its user may connect */
+    chmod(addr.sun_path, 0600);
+    return fd;
+}
+
+/* Helper method sends listening sockets with SCM_RIGHTS, the byte carried with them is their count */
+static bool send_listeners(int peer, const std::vector<int> & listeners) {
+    char count = (char) listeners.size();
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * STARTUP_MAX_LISTENERS)];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {&count, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * listeners.size());
+    struct cmsghdr * c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * listeners.size());
+    memcpy(CMSG_DATA(c), listeners.data(), sizeof(int) * listeners.size());
+    ssize_t sent;
+    while ((sent = sendmsg(peer, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {}
+    return sent == 1;
+}
+
+/*
+ * Waits on the handover socket for the next server. Once it is ready it gets
+ * the listening sockets, and the reactors stop accepting and drain. A peer of
+ * another user, or one that goes away before it is ready, is turned away.
+ */
+void handover_thread(int fd, std::vector<int> listeners, std::vector<Reactor *> reactors) {
+    while (true) {
+        int peer = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (peer == -1) {
+            /* EMFILE and alike are retried later instead of failing in a loop */
+            if (errno != EINTR && errno != ECONNABORTED) sleep(1);
+            continue;
+        }
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        char ready;
+        bool handed = !getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &cred, &len) && cred.uid == geteuid()
+                      && read(peer, &ready, 1) == 1 && send_listeners(peer, listeners);
+        close(peer);
+        if (handed) break;
+    }
+    /* Socket path belongs to the new server now */
+    close(fd);
+    for (size_t i=0; i<reactors.size(); i++) reactors[i]->stop();
+}
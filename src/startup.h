@@ -0,0 +1,27 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include "myhttpd.h"
+#include <sys/un.h>     // Unix socket address
+
+/* Startup settings */
+#define STARTUP_WARM_FILES                  10000       // most files read into the cache by the warm-up
+#define STARTUP_MAX_LISTENERS               64          // listening sockets handed over at most
+
+/*
+ * Restart without refusing connections. A server started with -U listens on
+ * a Unix socket; the next one started with the same path connects to it,
+ * warms its cache and then asks for the listening sockets, which are passed
+ * with SCM_RIGHTS. The old server stops accepting, closes idle keep-alive
+ * connections, answers requests it has already read and exits once its last
+ * connection is closed. Connections that wait in the accept queue meanwhile
+ * are taken by the new server, as the socket is the same.
+ */
+void warm_cache(const std::string &);
+int connect_handover(const std::string &);
+std::vector<int> take_listeners(int);
+int listen_handover(const std::string &);
+void handover_thread(int, std::vector<int>, std::vector<class Reactor *>);
+
+
+#endif
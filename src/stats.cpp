@@ -0,0 +1,190 @@
+
+#include "stats.h"
+#include "pool.h"
+#include "policy.h"
+
+
+static const char * stage_names[STAGE_COUNT] = {"parse", "queue", "content", "header", "send", "total"};
+
+thread_stats::thread_stats() : bytes_sent(0), busy(false) {
+    for (int i=0; i<STATS_MAX_STATUS; i++) statuses[i].store(0, std::memory_order_relaxed);
+}
+
+ServerStats::ServerStats() : started(monotonic_ns()), timer_ns(0) {}
+
+/* Measures cost of one clock read, which is the overhead of timing one stage */
+void ServerStats::calibrate() {
+    uint64_t start = monotonic_ns(), last = start;
+    for (int i=0; i<STATS_TIMER_CALIBRATION; i++) last = monotonic_ns();
+    timer_ns = (last - start) / STATS_TIMER_CALIBRATION;
+}
+
+/* Registers pool whose queue depth and workers are reported, called before workers start */
+void ServerStats::add_pool(WorkerPool * pool) {
+    std::lock_guard<std::mutex> lg(m);
+    pools.push_back(pool);
+}
+
+/* Returns counters of the calling thread, registered on first use. They outlive the thread */
+thread_stats * ServerStats::local() {
+    static thread_local thread_stats * mine = NULL;
+    if (!mine) {
+        mine = new thread_stats();
+        std::lock_guard<std::mutex> lg(m);
+        threads.push_back(mine);
+    }
+    return mine;
+}
+
+/* Counts response status and bytes written for it */
+void ServerStats::finished(int status, size_t bytes) {
+    thread_stats * ts = local();
+    ts->bytes_sent.store(ts->bytes_sent.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+    if (status >= 0 && status < STATS_MAX_STATUS) {
+        std::atomic<uint64_t> & counter = ts->statuses[status];
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+/* Helper method merges counters of all threads and reads queue depths */
+void ServerStats::collect(snapshot & snap) {
+    std::lock_guard<std::mutex> lg(m);
+    for (size_t i=0; i<threads.size(); i++) {
+        thread_stats * ts = threads[i];
+        for (int s=0; s<STAGE_COUNT; s++) snap.stages[s].merge(ts->stages[s]);
+        snap.bytes_sent += ts->bytes_sent.load(std::memory_order_relaxed);
+        for (int code=0; code<STATS_MAX_STATUS; code++)
+            snap.statuses[code] += ts->statuses[code].load(std::memory_order_relaxed);
+        snap.active += ts->busy.load(std::memory_order_relaxed);
+    }
+    std::vector<client_load> loads;
+    for (size_t i=0; i<pools.size(); i++) {
+        snap.workers += pools[i]->size();
+        snap.depth += pools[i]->depth();
+        pools[i]->client_loads(loads);
+        snap.pools.push_back(pool_report());
+        pools[i]->report(snap.pools.back());
+    }
+    /* Client may have requests in several shards */
+    std::unordered_map<uint32_t, client_load> merged;
+    for (size_t i=0; i<loads.size(); i++) {
+        std::unordered_map<uint32_t, client_load>::iterator it = merged.find(loads[i].key);
+        if (it == merged.end()) merged[loads[i].key] = loads[i];
+        else {
+            it->second.queued += loads[i].queued;
+            it->second.in_flight += loads[i].in_flight;
+            it->second.served += loads[i].served;
+        }
+    }
+    for (std::unordered_map<uint32_t, client_load>::iterator it = merged.begin(); it != merged.end(); ++it)
+        snap.clients.push_back(it->second);
+    std::sort(snap.clients.begin(), snap.clients.end(), [](const client_load & a, const client_load & b) {
+        return a.queued + a.in_flight > b.queued + b.in_flight;
+    });
+    if (snap.clients.size() > FAIR_REPORT_CLIENTS) snap.clients.resize(FAIR_REPORT_CLIENTS);
+}
+
+/* Returns status page as plain text or JSON */
+std::string ServerStats::render(bool json) {
+    std::unique_ptr<snapshot> snap(new snapshot());
+    collect(*snap);
+    uint64_t uptime = (monotonic_ns() - started) / 1000000000;
+    char date[64];
+    std::stringstream out;
+    if (json) {
+        out << "{\"uptime_s\":" << uptime << ",\"policy\":\"" << scheduling_policy->name()
+            << "\",\"workers\":" << snap->workers << ",\"active_workers\":" << snap->active
+            << ",\"queue_depth\":" << snap->depth << ",\"bytes_sent\":" << snap->bytes_sent
+            << ",\"timer_ns\":" << timer_ns << ",\"statuses\":{";
+        const char * sep = "";
+        for (int code=0; code<STATS_MAX_STATUS; code++) {
+            if (!snap->statuses[code]) continue;
+            out << sep << '"' << code << "\":" << snap->statuses[code];
+            sep = ",";
+        }
+        out << "},\"stages\":{";
+        for (int s=0; s<STAGE_COUNT; s++) {
+            Histogram & h = snap->stages[s];
+            out << (s ? "," : "") << '"' << stage_names[s] << "\":{\"count\":" << h.count()
+                << ",\"mean_ns\":" << h.mean() << ",\"p50_ns\":" << h.percentile(50)
+                << ",\"p90_ns\":" << h.percentile(90) << ",\"p99_ns\":" << h.percentile(99)
+                << ",\"p999_ns\":" << h.percentile(99.9) << ",\"max_ns\":" << h.max() << '}';
+        }
+        out << "},\"clients\":[";
+        for (size_t i=0; i<snap->clients.size(); i++) {
+            client_load & c = snap->clients[i];
+            out << (i ? "," : "") << "{\"client\":\"" << client_name(c.key, serv_params.fair_prefix)
+                << "\",\"queued\":" << c.queued << ",\"in_flight\":" << c.in_flight << ",\"served\":" << c.served << '}';
+        }
+        out << "],\"pools\":[";
+        for (size_t i=0; i<snap->pools.size(); i++) {
+            pool_report & p = snap->pools[i];
+            out << (i ? "," : "") << "{\"workers\":" << p.workers << ",\"max_workers\":" << p.max_workers
+                << ",\"resizes\":" << p.resizes;
+            if (p.resizes) {
+                get_time_for_logging(p.at, date);
+                out << ",\"last_resize\":{\"from\":" << p.from << ",\"to\":" << p.workers << ",\"at\":\"" << date
+                    << "\",\"wait_ms\":" << p.wait_ms << ",\"utilization\":" << p.utilization << '}';
+            }
+            out << '}';
+        }
+        out << "]}\n";
+        return out.str();
+    }
+    out << "uptime_s: " << uptime << "\npolicy: " << scheduling_policy->name()
+        << "\nworkers: " << snap->workers << "\nactive_workers: " << snap->active
+        << "\nqueue_depth: " << snap->depth << "\nbytes_sent: " << snap->bytes_sent
+        << "\ntimer_ns: " << timer_ns << '\n';
+    for (int code=0; code<STATS_MAX_STATUS; code++)
+        if (snap->statuses[code]) out << "status_" << code << ": " << snap->statuses[code] << '\n';
+    out << "\nstage\tcount\tmean_ns\tp50_ns\tp90_ns\tp99_ns\tp999_ns\tmax_ns\n";
+    for (int s=0; s<STAGE_COUNT; s++) {
+        Histogram & h = snap->stages[s];
+        out << stage_names[s] << '\t' << h.count() << '\t' << h.mean() << '\t' << h.percentile(50)
+            << '\t' << h.percentile(90) << '\t' << h.percentile(99) << '\t' << h.percentile(99.9)
+            << '\t' << h.max() << '\n';
+    }
+    /* Clients with most requests queued or being served, with fair queuing only */
+    if (!snap->clients.empty()) out << "\nclient\tqueued\tin_flight\tserved\n";
+    for (size_t i=0; i<snap->clients.size(); i++) {
+        client_load & c = snap->clients[i];
+        out << client_name(c.key, serv_params.fair_prefix) << '\t' << c.queued << '\t' << c.in_flight
+            << '\t' << c.served << '\n';
+    }
+    /* Sizes of adaptive pools and what made them change last */
+    if (serv_params.threads_min) out << "\npool\tworkers\tmax\tresizes\tlast_resize\n";
+    for (size_t i=0; serv_params.threads_min && i<snap->pools.size(); i++) {
+        pool_report & p = snap->pools[i];
+        out << i << '\t' << p.workers << '\t' << p.max_workers << '\t' << p.resizes << '\t';
+        if (p.resizes) {
+            char line[128];
+            get_time_for_logging(p.at, date);
+            snprintf(line, sizeof(line), "[%s] %d -> %d, queue wait %.1f ms, utilization %.0f%%", date, p.from,
+                     p.workers, p.wait_ms, p.utilization * 100);
+            out << line;
+        }
+        out << '\n';
+    }
+    return out.str();
+}
+
+/* Returns queuing and response time percentiles as a single line */
+std::string ServerStats::summary() {
+    std::unique_ptr<snapshot> snap(new snapshot());
+    collect(*snap);
+    Histogram & wait = snap->stages[STAGE_QUEUE], & total = snap->stages[STAGE_TOTAL];
+    std::stringstream out;
+    out << "scheduler: policy=" << scheduling_policy->name() << " requests=" << total.count()
+        << " queue_depth=" << snap->depth << " wait_us p50=" << wait.percentile(50) / 1000
+        << " p99=" << wait.percentile(99) / 1000 << " max=" << wait.max() / 1000
+        << " response_us mean=" << total.mean() / 1000 << " p50=" << total.percentile(50) / 1000
+        << " p90=" << total.percentile(90) / 1000 << " p99=" << total.percentile(99) / 1000
+        << " max=" << total.max() / 1000 << '\n';
+    return out.str();
+}
+
+/* Checks whether request is for the status page, with or without a query */
+bool is_status_request(const char * page) {
+    size_t len = strlen(SERVER_STATUS_PATH);
+    return !strncmp(page, SERVER_STATUS_PATH, len) && (page[len] == '\0' || page[len] == '?');
+}
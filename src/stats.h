@@ -0,0 +1,71 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "myhttpd.h"
+#include "histogram.h"
+
+/* Stats settings */
+#define STATS_MAX_STATUS                    600
+#define STATS_TIMER_CALIBRATION             10000   // clock reads timed at startup
+#define SERVER_STATUS_PATH                  "/server-status"
+
+/* Stages of a request, each gets its own latency histogram */
+enum stage {
+    STAGE_PARSE,                                        // request head to request object, on the reactor
+    STAGE_QUEUE,                                        // arrival to first worker pick-up
+    STAGE_CONTENT,                                      // cache lookup, stat, open or directory listing
+    STAGE_HEADER,                                       // response header build
+    STAGE_SEND,                                         // header and body writes, all chunks together
+    STAGE_TOTAL,                                        // arrival to last byte sent
+    STAGE_COUNT
+};
+
+/* Counters of one thread. Only the owner writes them, readers may see slightly old values */
+struct thread_stats {
+    Histogram stages[STAGE_COUNT];
+    std::atomic<uint64_t> bytes_sent;
+    std::atomic<uint64_t> statuses[STATS_MAX_STATUS];
+    std::atomic<bool> busy;
+    thread_stats();
+};
+
+/*
+ * Server statistics. Every thread records into its own histograms and counters
+ * with plain stores, nothing is shared on the request path. Reports merge all
+ * threads on demand, for SIGUSR1 and for the /server-status page. Every stage
+ * costs one clock read, whose cost is measured at startup and reported.
+ */
+class ServerStats {
+public:
+    ServerStats();
+    void calibrate();
+    void add_pool(class WorkerPool *);
+    thread_stats * local();
+    void record(stage s, uint64_t ns) { local()->stages[s].add(ns); }
+    void finished(int, size_t);
+    void set_busy(bool busy) { local()->busy.store(busy, std::memory_order_relaxed); }
+    std::string render(bool);
+    std::string summary();
+private:
+    struct snapshot {
+        Histogram stages[STAGE_COUNT];
+        uint64_t bytes_sent = 0, statuses[STATS_MAX_STATUS] = {0};
+        int workers = 0, active = 0;
+        size_t depth = 0;
+        std::vector<struct client_load> clients;        // busiest first, FAIR_REPORT_CLIENTS at most
+        std::vector<struct pool_report> pools;
+    };
+    void collect(snapshot &);
+
+    std::mutex m;                                       // guards threads and pools
+    std::vector<thread_stats *> threads;
+    std::vector<class WorkerPool *> pools;
+    uint64_t started, timer_ns;
+};
+
+bool is_status_request(const char *);
+
+extern ServerStats server_stats;
+
+
+#endif
@@ -0,0 +1,128 @@
+
+#include "topology.h"
+
+
+/* Helper method reads a number from a sysfs file, fallback if there is none */
+static int read_number(const std::string & path, int fallback) {
+    std::ifstream in(path.c_str());
+    int value;
+    return in >> value ? value : fallback;
+}
+
+/* Helper method finds NUMA node of cpu by its nodeN link, 0 without NUMA */
+static int node_of(int cpu) {
+    std::string dir = TOPOLOGY_SYSFS "/cpu" + std::to_string(cpu);
+    DIR * d = opendir(dir.c_str());
+    int node = 0;
+    if (!d) return node;
+    while (struct dirent * entry = readdir(d)) {
+        if (!strncmp(entry->d_name, "node", 4) && isdigit((unsigned char) entry->d_name[4])) {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(d);
+    return node;
+}
+
+/* Returns place of every CPU the process may run on, in CPU order */
+std::vector<cpu_place> read_topology() {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set)) {
+        CPU_ZERO(&set);
+        for (long cpu=0; cpu<sysconf(_SC_NPROCESSORS_ONLN) && cpu<CPU_SETSIZE; cpu++) CPU_SET(cpu, &set);
+    }
+    std::vector<cpu_place> places;
+    for (int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set)) continue;
+        std::string topology = TOPOLOGY_SYSFS "/cpu" + std::to_string(cpu) + "/topology/";
+        cpu_place p;
+        p.cpu = cpu;
+        p.core = read_number(topology + "core_id", cpu);
+        p.package = read_number(topology + "physical_package_id", 0);
+        p.node = node_of(cpu);
+        p.thread = 0;
+        /* Core ids are unique within a package only */
+        for (size_t i=0; i<places.size(); i++)
+            if (places[i].core == p.core && places[i].package == p.package) p.thread++;
+        places.push_back(p);
+    }
+    return places;
+}
+
+/* Returns CPU for every shard, more shards than CPUs wrap around */
+std::vector<int> shard_cpus(const std::vector<cpu_place> & places, int shards) {
+    std::vector<cpu_place> order(places);
+    std::stable_sort(order.begin(), order.end(), [](const cpu_place & a, const cpu_place & b) {
+        if (a.thread != b.thread) return a.thread < b.thread;
+        if (a.node != b.node) return a.node < b.node;
+        if (a.package != b.package) return a.package < b.package;
+        return a.core < b.core;
+    });
+    std::vector<int> cpus;
+    for (int i=0; i<shards; i++) cpus.push_back(order.empty() ? -1 : order[i % order.size()].cpu);
+    return cpus;
+}
+
+/* Returns CPUs on the NUMA node of cpu, for the workers of the shard pinned to it */
+std::vector<int> node_cpus(const std::vector<cpu_place> & places, int cpu) {
+    std::vector<int> cpus;
+    int node = -1;
+    for (size_t i=0; i<places.size(); i++)
+        if (places[i].cpu == cpu) node = places[i].node;
+    for (size_t i=0; i<places.size(); i++)
+        if (places[i].node == node) cpus.push_back(places[i].cpu);
+    return cpus;
+}
+
+/*
+ * Makes the kernel hand a new connection to the listening socket of the shard
+ * pinned to the CPU that received it, so with RSS or RPS spreading flows over
+ * CPUs a connection is accepted, read and served on one core. A CPU without a
+ * shard goes to a shard on another hardware thread of its core, else to the
+ * shards of its node in turn, else by CPU number. Sockets of a SO_REUSEPORT
+ * group are numbered in the order they were bound, which is the shard order.
+ */
+void steer_connections(int fd, const std::vector<cpu_place> & places, const std::vector<int> & cpus) {
+    int shards = cpus.size();
+    std::vector<const cpu_place *> shard_places(shards, (const cpu_place *) NULL);
+    for (int s=0; s<shards; s++)
+        for (size_t i=0; i<places.size(); i++)
+            if (places[i].cpu == cpus[s]) shard_places[s] = &places[i];
+    std::vector<struct sock_filter> code;
+    struct sock_filter load_cpu = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (unsigned) (SKF_AD_OFF + SKF_AD_CPU));
+    code.push_back(load_cpu);
+    std::vector<int> turn;                              // next shard of a node, by node
+    for (size_t i=0; i<places.size(); i++) {
+        const cpu_place & p = places[i];
+        int shard = -1;
+        for (int s=0; s<shards && shard == -1; s++)
+            if (cpus[s] == p.cpu) shard = s;
+        for (int s=0; s<shards && shard == -1; s++)
+            if (shard_places[s] && shard_places[s]->core == p.core && shard_places[s]->package == p.package)
+                shard = s;
+        if (shard == -1) {
+            std::vector<int> local;
+            for (int s=0; s<shards; s++)
+                if (shard_places[s] && shard_places[s]->node == p.node) local.push_back(s);
+            if (local.empty()) continue;
+            if ((int) turn.size() <= p.node) turn.resize(p.node + 1, 0);
+            shard = local[turn[p.node]++ % local.size()];
+        }
+        struct sock_filter match = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned) p.cpu, 0, 1);
+        struct sock_filter pick = BPF_STMT(BPF_RET | BPF_K, (unsigned) shard);
+        code.push_back(match);
+        code.push_back(pick);
+    }
+    struct sock_filter spread = BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned) shards);
+    struct sock_filter pick_spread = BPF_STMT(BPF_RET | BPF_A, 0);
+    code.push_back(spread);
+    code.push_back(pick_spread);
+    /* Kernel takes the usual hash when the program can not be attached */
+    if (code.size() > BPF_MAXINSNS) return;
+    struct sock_fprog prog;
+    prog.len = code.size();
+    prog.filter = code.data();
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+        perror("cannot steer connections to their CPU");
+}
@@ -0,0 +1,29 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include "myhttpd.h"
+#include <linux/filter.h> // classic BPF for SO_ATTACH_REUSEPORT_CBPF
+
+/* Topology settings */
+#define TOPOLOGY_SYSFS                      "/sys/devices/system/cpu"
+
+/* Place of a CPU the process may run on */
+struct cpu_place {
+    int cpu, core, package, node;
+    int thread;                                         // order among hardware threads of its core
+};
+
+/*
+ * CPUs for shards, read from sysfs and limited to the affinity mask of the
+ * process, so a cpuset of a container is respected. Shards get a physical core
+ * each before any gets the second hardware thread of a core, and fill a NUMA
+ * node before they move to the next one, so a small server shares its caches
+ * within one node. Without sysfs every CPU counts as a core of its own.
+ */
+std::vector<cpu_place> read_topology();
+std::vector<int> shard_cpus(const std::vector<cpu_place> &, int);
+std::vector<int> node_cpus(const std::vector<cpu_place> &, int);
+void steer_connections(int, const std::vector<cpu_place> &, const std::vector<int> &);
+
+
+#endif
@@ -0,0 +1,96 @@
+
+#include "uring.h"
+
+
+Ring::Ring() : fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sq_ring_len(0), cq_ring_len(0),
+    sqes_len(0), sqes((struct io_uring_sqe *) MAP_FAILED), sqe_tail(0), sq_entries(0) {}
+
+Ring::~Ring() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_len);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_len);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_len);
+    if (fd != -1) close(fd);
+}
+
+/*
+ * Creates the ring with room for entries submissions and cq_entries
+ * completions and maps it. Flags that only make it faster are dropped if the
+ * kernel is too old for them. Returns false with errno set on failure.
+ */
+bool Ring::setup(unsigned entries, unsigned cq_entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN
+                   | IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = cq_entries;
+    if ((fd = syscall(__NR_io_uring_setup, entries, &params)) == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (fd == -1) return false;
+    sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    /* Newer kernels map both rings at once */
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_len = cq_ring_len = std::max(sq_ring_len, cq_ring_len);
+    sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) return false;
+    cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring
+              : mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) return false;
+    sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *) mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                        fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+    char * sq = (char *) sq_ring, * cq = (char *) cq_ring;
+    sq_head = (unsigned *) (sq + params.sq_off.head);
+    sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    sq_array = (unsigned *) (sq + params.sq_off.array);
+    cq_head = (unsigned *) (cq + params.cq_off.head);
+    cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    sq_entries = params.sq_entries;
+    sqe_tail = *sq_tail;
+    return true;
+}
+
+/* Registers descriptors used with IOSQE_FIXED_FILE, by their index in fds */
+bool Ring::register_files(const int * fds, unsigned count) {
+    return syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, fds, count) == 0;
+}
+
+/* Returns cleared submission entry queued for the next submit(), the queue is flushed if it is full */
+struct io_uring_sqe * Ring::get_sqe() {
+    while (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+        if (submit(0) == -1 && errno != EINTR && errno != EBUSY && errno != EAGAIN) return NULL;
+    unsigned index = sqe_tail & *sq_mask;
+    struct io_uring_sqe * sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    sqe_tail++;
+    return sqe;
+}
+
+/* Hands queued submissions to the kernel and waits until at least wait completions are there */
+int Ring::submit(unsigned wait) {
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    unsigned pending = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (!pending && !wait) return 0;
+    return syscall(__NR_io_uring_enter, fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* Returns oldest completion not yet seen, or NULL */
+struct io_uring_cqe * Ring::completion() {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &cqes[head & *cq_mask];
+}
+
+/* Gives the completion returned by completion() back to the kernel */
+void Ring::seen() {
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
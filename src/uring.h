@@ -0,0 +1,41 @@
+#ifndef URING_H
+#define URING_H
+
+#include "myhttpd.h"
+#include <linux/io_uring.h>  // ring layout and opcodes, used through raw system calls
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+/* Ring settings */
+#define URING_ENTRIES                       1024
+#define URING_CQ_ENTRIES                    (URING_ENTRIES * 4)
+
+/*
+ * io_uring instance owned by one thread, driven with the raw system calls.
+ * Submissions are queued with get_sqe() and handed to the kernel together by
+ * submit(), which also waits for completions; completions are read in place
+ * with completion() and given back with seen().
+ */
+class Ring {
+public:
+    Ring();
+    ~Ring();
+    bool setup(unsigned, unsigned);
+    bool register_files(const int *, unsigned);
+    struct io_uring_sqe * get_sqe();
+    int submit(unsigned);
+    struct io_uring_cqe * completion();
+    void seen();
+private:
+    int fd;
+    void * sq_ring, * cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+    unsigned * sq_head, * sq_tail, * sq_mask, * sq_array;
+    unsigned * cq_head, * cq_tail, * cq_mask;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+    unsigned sqe_tail, sq_entries;
+};
+
+
+#endif
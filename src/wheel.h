@@ -0,0 +1,147 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Hierarchical timing wheel of intrusive timers. Level 0 has a slot for each
+ * of the next WHEEL_SLOTS ticks, every higher level a slot for WHEEL_SLOTS
+ * times the span of a slot below. Timers far away sit in a coarse slot and
+ * move down a level when the wheel reaches that slot, so setting, cancelling
+ * and expiring a timer are O(1) and a tick only touches the slots it passes.
+ * Timers further away than the wheel covers are kept in its farthest slot and
+ * placed again when it is reached. Owned by one thread.
+ */
+#define WHEEL_BITS                          8
+#define WHEEL_SLOTS                         (1 << WHEEL_BITS)
+#define WHEEL_LEVELS                        3
+#define WHEEL_TICK_MS                       100
+
+struct wheel_timer {
+    wheel_timer * prev = NULL, * next = NULL;           // slot list, or list of expired timers
+    wheel_timer ** slot = NULL;                         // head of the slot list
+    uint64_t expires = 0;                               // tick
+    bool armed = false;
+    void * data = NULL;                                 // owner of the timer
+};
+
+class TimerWheel {
+public:
+    TimerWheel() : now(0), count(0) {
+        for (int l=0; l<WHEEL_LEVELS; l++)
+            for (int i=0; i<WHEEL_SLOTS; i++) slots[l][i] = NULL;
+    }
+
+    /* Starts the wheel at tick, before any timer is set */
+    void start(uint64_t tick) { now = tick; }
+
+    /* Sets timer to expire ticks from now, moving it if it was set */
+    void set(wheel_timer * t, uint64_t ticks) {
+        if (t->armed) unlink(t);
+        t->expires = now + (ticks ? ticks : 1);
+        place(t);
+        count++;
+    }
+
+    void cancel(wheel_timer * t) {
+        if (!t->armed) return;
+        unlink(t);
+        count--;
+    }
+
+    bool empty() const { return !count; }
+
+    /* Tick the wheel has been moved to, deadlines are relative to it */
+    uint64_t current() const { return now; }
+
+    /* Takes every timer off the wheel and returns them linked through next, their ticks are kept */
+    wheel_timer * take_all() {
+        wheel_timer * all = NULL;
+        for (int l=0; l<WHEEL_LEVELS; l++) {
+            for (int i=0; i<WHEEL_SLOTS; i++) {
+                wheel_timer * t = slots[l][i];
+                slots[l][i] = NULL;
+                while (t) {
+                    wheel_timer * next = t->next;
+                    t->prev = NULL;
+                    t->armed = false;
+                    t->next = all;
+                    all = t;
+                    t = next;
+                }
+            }
+        }
+        count = 0;
+        return all;
+    }
+
+    /* Moves wheel up to tick and returns timers that expired on the way, linked through next */
+    wheel_timer * advance(uint64_t tick) {
+        wheel_timer * expired = NULL;
+        while (now < tick) {
+            now++;
+            /* Slot of each level is brought down once the wheel enters it */
+            for (int l=1; l<WHEEL_LEVELS && !(now & ((1ULL << (WHEEL_BITS * l)) - 1)); l++)
+                cascade(l, (now >> (WHEEL_BITS * l)) & (WHEEL_SLOTS - 1));
+            wheel_timer * t = slots[0][now & (WHEEL_SLOTS - 1)];
+            slots[0][now & (WHEEL_SLOTS - 1)] = NULL;
+            while (t) {
+                wheel_timer * next = t->next;
+                t->prev = NULL;
+                t->armed = false;
+                count--;
+                if (t->expires > now) set(t, t->expires - now);
+                else {
+                    t->next = expired;
+                    expired = t;
+                }
+                t = next;
+            }
+        }
+        return expired;
+    }
+
+private:
+    /* Helper method puts armed timer into the slot of the lowest level that reaches its tick */
+    void place(wheel_timer * t) {
+        uint64_t delta = t->expires - now, at = t->expires;
+        int l = 0;
+        while (l < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (l + 1)))) l++;
+        /* Beyond the last level it waits in the farthest slot */
+        if (delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS))) at = now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        wheel_timer *& head = slots[l][(at >> (WHEEL_BITS * l)) & (WHEEL_SLOTS - 1)];
+        t->prev = NULL;
+        t->next = head;
+        if (head) head->prev = t;
+        head = t;
+        t->slot = &head;
+        t->armed = true;
+    }
+
+    void unlink(wheel_timer * t) {
+        if (t->prev) t->prev->next = t->next;
+        else *t->slot = t->next;
+        if (t->next) t->next->prev = t->prev;
+        t->prev = t->next = NULL;
+        t->armed = false;
+    }
+
+    /* Helper method places timers of a higher level slot again, closer to their tick */
+    void cascade(int l, size_t i) {
+        wheel_timer * t = slots[l][i];
+        slots[l][i] = NULL;
+        while (t) {
+            wheel_timer * next = t->next;
+            place(t);
+            t = next;
+        }
+    }
+
+    wheel_timer * slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t now;
+    size_t count;
+};
+
+
+#endif